@@ -0,0 +1,348 @@
+#include "analysiscache.hpp"
+#include "imageanalyser.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <optional>
+#include <qcommandlineparser.h>
+#include <qcoreapplication.h>
+#include <qdiriterator.h>
+#include <qelapsedtimer.h>
+#include <qfile.h>
+#include <qfileinfo.h>
+#include <qimage.h>
+#include <qimagereader.h>
+#include <qpromise.h>
+#include <qrandom.h>
+#include <qtextstream.h>
+
+namespace {
+
+// Counts operator new only, QImage pixel buffers come from malloc and are not included
+std::atomic<std::size_t> allocations{ 0 };
+
+} // namespace
+
+void* operator new(std::size_t size) {
+    ++allocations;
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+
+using caelestia::AnalysisResult;
+using caelestia::ImageAnalyser;
+
+constexpr qreal LUMINANCE_TOLERANCE = 0.01; // Smooth scaling blends the pixels along edges
+constexpr qreal COMPARE_TOLERANCE = 0.001;
+
+struct Sample {
+    QString name;
+    QString path; // Empty for generated images
+    QImage image;
+    // Known answer for generated images. Only the dominant colour and luminance are checked
+    std::optional<AnalysisResult> expected;
+};
+
+qreal perceivedLuminance(QRgb rgb) {
+    const qreal r = qRed(rgb) / 255.0;
+    const qreal g = qGreen(rgb) / 255.0;
+    const qreal b = qBlue(rgb) / 255.0;
+    return std::sqrt(0.299 * r * r + 0.587 * g * g + 0.114 * b * b);
+}
+
+QColor histogramBin(QRgb rgb) {
+    // The analyser reports the lower bound of a 5 bit per channel bin
+    return QColor(qRed(rgb) & 0xF8, qGreen(rgb) & 0xF8, qBlue(rgb) & 0xF8);
+}
+
+Sample solid(QRgb rgb) {
+    QImage image(1920, 1080, QImage::Format_ARGB32);
+    image.fill(rgb);
+    return { QString("solid-%1").arg(rgb & 0xFFFFFF, 6, 16, QChar('0')), QString(), image,
+        AnalysisResult{ histogramBin(rgb), perceivedLuminance(rgb), {} } };
+}
+
+Sample twoTone(QRgb major, QRgb minor) {
+    // 70% of the width is major, so it must win the histogram and weigh 0.7 in the luminance
+    QImage image(1920, 1080, QImage::Format_ARGB32);
+    const int split = image.width() * 7 / 10;
+    for (int y = 0; y < image.height(); ++y) {
+        auto* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < image.width(); ++x) {
+            line[x] = x < split ? major : minor;
+        }
+    }
+    return { "two-tone", QString(), image,
+        AnalysisResult{ histogramBin(major), 0.7 * perceivedLuminance(major) + 0.3 * perceivedLuminance(minor), {} } };
+}
+
+Sample gradient() {
+    QImage image(1920, 1080, QImage::Format_ARGB32);
+    for (int y = 0; y < image.height(); ++y) {
+        auto* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < image.width(); ++x) {
+            line[x] = QColor::fromHsv(x * 359 / (image.width() - 1), 200, 64 + y * 191 / (image.height() - 1)).rgb();
+        }
+    }
+    return { "gradient", QString(), image, std::nullopt };
+}
+
+Sample noise(int width, int height) {
+    QRandomGenerator rng(1); // Fixed seed so runs are comparable
+    QImage image(width, height, QImage::Format_ARGB32);
+    for (int y = 0; y < height; ++y) {
+        auto* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < width; ++x) {
+            line[x] = 0xFF000000u | (rng.generate() & 0xFFFFFFu);
+        }
+    }
+    return { QString("noise-%1x%2").arg(width).arg(height), QString(), image, std::nullopt };
+}
+
+QList<Sample> generatedSamples() {
+    return {
+        solid(0xFF4285F4),
+        solid(0xFFE0E0E0),
+        solid(0xFF101418),
+        twoTone(0xFF1E3A5F, 0xFFF2C14E),
+        gradient(),
+        noise(512, 512),
+        noise(3840, 2160),
+    };
+}
+
+QList<Sample> fileSamples(const QStringList& args) {
+    QStringList paths;
+    for (const auto& arg : args) {
+        if (QFileInfo(arg).isDir()) {
+            QDirIterator it(arg, QDir::Files, QDirIterator::Subdirectories);
+            while (it.hasNext()) {
+                paths << it.next();
+            }
+        } else {
+            paths << arg;
+        }
+    }
+    paths.sort();
+
+    QList<Sample> samples;
+    for (const auto& path : paths) {
+        QImageReader reader(path);
+        if (!reader.canRead()) {
+            continue;
+        }
+
+        const QImage image = reader.read();
+        if (image.isNull()) {
+            qWarning() << "imageanalyser-bench: failed to read" << path << "-" << reader.errorString();
+            continue;
+        }
+        samples << Sample{ QFileInfo(path).fileName(), path, image, std::nullopt };
+    }
+    return samples;
+}
+
+std::optional<AnalysisResult> analyse(const Sample& sample, int rescaleSize, int paletteSize, bool decode) {
+    QPromise<AnalysisResult> promise;
+    auto future = promise.future();
+    promise.start();
+
+    if (decode) {
+        ImageAnalyser::analyseSource(promise, sample.path, rescaleSize, paletteSize, QRectF(), QString());
+    } else {
+        ImageAnalyser::analyse(promise, sample.image, rescaleSize, paletteSize, QRectF());
+    }
+
+    promise.finish();
+    if (!future.isResultReadyAt(0)) {
+        return std::nullopt;
+    }
+    return future.resultAt(0);
+}
+
+QHash<QString, AnalysisResult> readResults(const QString& path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << "imageanalyser-bench: failed to open" << path;
+        return {};
+    }
+
+    // One "name<TAB>rescaleSize<TAB>#rrggbb<TAB>luminance" line per run
+    QHash<QString, AnalysisResult> results;
+    QTextStream stream(&file);
+    while (!stream.atEnd()) {
+        const auto parts = stream.readLine().split('\t');
+        if (parts.size() == 4) {
+            const AnalysisResult result{ QColor(parts.at(2)), parts.at(3).toDouble(), {} };
+            results.insert(parts.at(0) + "\t" + parts.at(1), result);
+        }
+    }
+    return results;
+}
+
+bool matches(const AnalysisResult& result, const AnalysisResult& expected, qreal tolerance) {
+    return result.dominantColour == expected.dominantColour &&
+           std::abs(result.luminance - expected.luminance) <= tolerance;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("imageanalyser-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures ImageAnalyser throughput and checks its results against known answers");
+    parser.addHelpOption();
+    parser.addPositionalArgument("paths", "Sample images or directories of them, in addition to generated images.",
+        "[paths...]");
+
+    const QCommandLineOption iterationsOption({ "i", "iterations" }, "Timed runs per image and size.", "n", "10");
+    const QCommandLineOption sizesOption({ "r", "rescale-sizes" },
+        "Comma separated rescaleSize values, 0 analyses at full size.", "sizes", "0,64,128,256");
+    const QCommandLineOption paletteOption({ "p", "palette-size" }, "paletteSize to analyse with.", "n", "0");
+    const QCommandLineOption saveOption("save", "Write results to file for a later --compare.", "file");
+    const QCommandLineOption compareOption(
+        "compare", "Fail if the dominant colour or luminance differs from a file written by --save.", "file");
+    parser.addOptions({ iterationsOption, sizesOption, paletteOption, saveOption, compareOption });
+    parser.process(app);
+
+    const int iterations = qMax(1, parser.value(iterationsOption).toInt());
+    const int paletteSize = parser.value(paletteOption).toInt();
+
+    QList<int> rescaleSizes;
+    for (const auto& size : parser.value(sizesOption).split(',', Qt::SkipEmptyParts)) {
+        rescaleSizes << size.toInt();
+    }
+
+    QList<Sample> samples = generatedSamples();
+    samples << fileSamples(parser.positionalArguments());
+
+    const auto golden =
+        parser.isSet(compareOption) ? readResults(parser.value(compareOption)) : QHash<QString, AnalysisResult>();
+
+    QFile saveFile;
+    QTextStream save;
+    if (parser.isSet(saveOption)) {
+        saveFile.setFileName(parser.value(saveOption));
+        if (!saveFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+            qWarning() << "imageanalyser-bench: failed to open" << saveFile.fileName();
+            return 1;
+        }
+        save.setDevice(&saveFile);
+    }
+
+    QTextStream out(stdout);
+    out << QString("%1 %2 %3 %4 %5 %6 %7\n")
+               .arg(QString("image"), -28)
+               .arg(QString("mode"), -7)
+               .arg(QString("rescale"), 8)
+               .arg(QString("ms/run"), 10)
+               .arg(QString("Mpx/s"), 10)
+               .arg(QString("allocs"), 8)
+               .arg(QString("result"), -16);
+
+    int failures = 0;
+    for (const auto& sample : samples) {
+        // Files are also measured through analyseSource, which includes the scaled decode
+        QList<bool> modes{ false };
+        if (!sample.path.isEmpty()) {
+            modes << true;
+        }
+
+        for (const bool decode : modes) {
+            for (const int rescaleSize : rescaleSizes) {
+                const auto warmup = analyse(sample, rescaleSize, paletteSize, decode);
+                if (!warmup) {
+                    out << sample.name << ": no result\n";
+                    ++failures;
+                    continue;
+                }
+
+                const std::size_t allocationsBefore = allocations;
+                QElapsedTimer timer;
+                timer.start();
+                for (int i = 0; i < iterations; ++i) {
+                    (void)analyse(sample, rescaleSize, paletteSize, decode);
+                }
+                const qint64 nsecs = timer.nsecsElapsed();
+                const std::size_t runAllocations =
+                    (allocations - allocationsBefore) / static_cast<std::size_t>(iterations);
+
+                const qreal msPerRun = static_cast<qreal>(nsecs) / 1e6 / iterations;
+                const qreal pixels = static_cast<qreal>(sample.image.width()) * sample.image.height();
+                const qreal megapixelsPerSec = pixels * iterations / (static_cast<qreal>(nsecs) / 1e9) / 1e6;
+
+                QString status;
+                if (sample.expected) {
+                    if (matches(*warmup, *sample.expected, LUMINANCE_TOLERANCE)) {
+                        status = " ok";
+                    } else {
+                        status = QString(" FAIL expected %1 %2")
+                                     .arg(sample.expected->dominantColour.name())
+                                     .arg(sample.expected->luminance, 0, 'f', 4);
+                        ++failures;
+                    }
+                }
+
+                const QString key = sample.name + "\t" + QString::number(rescaleSize);
+                if (const auto it = golden.constFind(key); !decode && it != golden.cend()) {
+                    if (!matches(*warmup, *it, COMPARE_TOLERANCE)) {
+                        status += QString(" CHANGED from %1 %2")
+                                      .arg(it->dominantColour.name())
+                                      .arg(it->luminance, 0, 'f', 4);
+                        ++failures;
+                    }
+                }
+
+                if (!decode && save.device()) {
+                    save << key << "\t" << warmup->dominantColour.name() << "\t"
+                         << QString::number(warmup->luminance, 'f', 6) << "\n";
+                }
+
+                out << QString("%1 %2 %3 %4 %5 %6 %7 %8%9\n")
+                           .arg(sample.name.left(28), -28)
+                           .arg(QString(decode ? "decode" : "memory"), -7)
+                           .arg(rescaleSize, 8)
+                           .arg(msPerRun, 10, 'f', 3)
+                           .arg(megapixelsPerSec, 10, 'f', 1)
+                           .arg(runAllocations, 8)
+                           .arg(warmup->dominantColour.name())
+                           .arg(warmup->luminance, 0, 'f', 4)
+                           .arg(status);
+                out.flush();
+            }
+        }
+    }
+
+    if (failures > 0) {
+        out << failures << " check(s) failed\n";
+        return 1;
+    }
+    return 0;
+}
@@ -7,8 +7,11 @@ Image {
     id: root
 
     property alias path: manager.path
+    // Plays animated sources, with frames decoded at the displayed size rather than the original's
+    property bool animate: false
 
     asynchronous: true
+    retainWhileLoading: true
     fillMode: Image.PreserveAspectCrop
 
     Connections {
@@ -19,6 +22,20 @@ Image {
         }
     }
 
+    Loader {
+        anchors.fill: parent
+
+        active: root.animate && manager.animated
+        asynchronous: true
+
+        sourceComponent: AnimatedImage {
+            source: Qt.resolvedUrl(root.path)
+            sourceSize: manager.frameSize
+            fillMode: root.fillMode
+            playing: root.visible
+        }
+    }
+
     CachingImageManager {
         id: manager
 
@@ -5,6 +5,7 @@ JsonObject {
     property bool showOnHover: false
     property int maxShown: 7
     property int maxWallpapers: 9 // Warning: even numbers look bad
+    property string wallpaperSort: "name" // One of name, luminance, hue
     property string specialPrefix: "@"
     property string actionPrefix: ">"
     property bool enableDangerousActions: false // Allow actions that can cause losing data, like shutdown, reboot and logout
@@ -19,7 +20,6 @@ JsonObject {
         property bool actions: false
         property bool schemes: false
         property bool variants: false
-        property bool wallpapers: false
     }
 
     component Sizes: JsonObject {
@@ -73,7 +73,10 @@ MouseArea {
 
     function save(): void {
         const tmpfile = Qt.resolvedUrl(`/tmp/caelestia-picker-${Quickshell.processId}-${Date.now()}.png`);
-        CUtils.saveItem(screencopy, tmpfile, Qt.rect(Math.ceil(rsx), Math.ceil(rsy), Math.floor(sw), Math.floor(sh)), path => Quickshell.execDetached(["swappy", "-f", path]));
+        CUtils.saveItemWith(screencopy, {
+            path: tmpfile,
+            rect: Qt.rect(Math.ceil(rsx), Math.ceil(rsy), Math.floor(sw), Math.floor(sh))
+        }, result => Quickshell.execDetached(["swappy", "-f", result.path]), error => Toaster.toast(qsTr("Screenshot failed"), error, "error", Toast.Error));
         closeAnim.start();
     }
 
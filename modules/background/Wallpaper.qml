@@ -114,6 +114,7 @@ Item {
         }
 
         anchors.fill: parent
+        animate: true
 
         opacity: 0
         scale: Wallpapers.showPreview ? 1 : 0.8
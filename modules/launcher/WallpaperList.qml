@@ -4,6 +4,7 @@ import "items"
 import qs.components.controls
 import qs.services
 import qs.config
+import Caelestia.Models
 import Quickshell
 import QtQuick
 
@@ -35,7 +36,7 @@ PathView {
             return 0;
 
         const maxItemsOnScreen = Math.floor(maxWidth / itemWidth);
-        const visible = Math.min(maxItemsOnScreen, Config.launcher.maxWallpapers, scriptModel.values.length);
+        const visible = Math.min(maxItemsOnScreen, Config.launcher.maxWallpapers, filterModel.count);
 
         if (visible === 2)
             return 1;
@@ -44,16 +45,36 @@ PathView {
         return visible;
     }
 
-    model: ScriptModel {
-        id: scriptModel
+    function resetCurrentIndex(): void {
+        currentIndex = filterModel.query ? 0 : filterModel.indexOf("path", Wallpapers.actualCurrent);
+    }
+
+    model: FilterProxyModel {
+        id: filterModel
+
+        sourceModel: Wallpapers.analysis
+        roleName: "relativePath"
+        sortRoleName: Config.launcher.wallpaperSort === "name" ? "" : Config.launcher.wallpaperSort
+        mode: FilterProxyModel.Fuzzy
+        query: root.search.text.split(" ").slice(1).join(" ")
+
+        onQueryChanged: root.resetCurrentIndex()
+    }
+
+    // Wallpapers stream in while the directory is walked, so the current one may only show up after opening
+    Connections {
+        target: filterModel
 
-        readonly property string search: root.search.text.split(" ").slice(1).join(" ")
+        function onRowsInserted(): void {
+            root.resetCurrentIndex();
+        }
 
-        values: Wallpapers.query(search)
-        onValuesChanged: root.currentIndex = search ? 0 : values.findIndex(w => w.path === Wallpapers.actualCurrent)
+        function onModelReset(): void {
+            root.resetCurrentIndex();
+        }
     }
 
-    Component.onCompleted: currentIndex = Wallpapers.list.findIndex(w => w.path === Wallpapers.actualCurrent)
+    Component.onCompleted: resetCurrentIndex()
     Component.onDestruction: Wallpapers.stopPreview()
 
     onCurrentItemChanged: {
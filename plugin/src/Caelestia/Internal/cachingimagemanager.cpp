@@ -1,16 +1,194 @@
 #include "cachingimagemanager.hpp"
 
+#include "imagecache.hpp"
 #include <QtQuick/qquickwindow.h>
+#include <array>
 #include <qcryptographichash.h>
+#include <qdatetime.h>
 #include <qdir.h>
 #include <qfileinfo.h>
 #include <qfuturewatcher.h>
 #include <qimagereader.h>
+#include <qmutex.h>
 #include <qpainter.h>
+#include <qqmlengine.h>
+#include <qsavefile.h>
 #include <qtconcurrentrun.h>
+#include <qthreadpool.h>
 
 namespace caelestia::internal {
 
+namespace {
+
+constexpr int PREVIEW_SIZE = 64;
+constexpr int MIP_QUALITY = 80; // PNG quality maps to zlib level, levels are intermediates so favour speed
+constexpr qsizetype MAX_PENDING_PYRAMIDS = 4; // Unwritten pyramids held in memory, roughly 15 MB each for a 4K source
+
+QString mipFileName(const QString& hash, qsizetype level) {
+    return QString("%1@mip%2.png").arg(hash).arg(level);
+}
+
+QString mipIndexFileName(const QString& hash) {
+    return QString("%1@mip.txt").arg(hash);
+}
+
+QMutex& pyramidMutex(const QString& hash) {
+    // Striped so requests for different sizes of the same source wait for a single pyramid build
+    static std::array<QMutex, 16> mutexes;
+    return mutexes[qHash(hash) % mutexes.size()];
+}
+
+// Hashing reads the whole file, so a path's hash is remembered for as long as its size and mtime stay the same
+struct HashedFile {
+    qint64 size;
+    QDateTime modified;
+    QString hash;
+};
+
+struct HashMemo {
+    QMutex mutex;
+    QHash<QString, HashedFile> files;
+};
+
+HashMemo& hashMemo() {
+    static HashMemo memo;
+    return memo;
+}
+
+Qt::AspectRatioMode aspectRatioMode(const QString& fillMode) {
+    if (fillMode == "PreserveAspectCrop") {
+        return Qt::KeepAspectRatioByExpanding;
+    }
+    if (fillMode == "PreserveAspectFit") {
+        return Qt::KeepAspectRatio;
+    }
+    return Qt::IgnoreAspectRatio;
+}
+
+QList<QSize> readPyramid(const QString& index) {
+    QFile file(index);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return {};
+    }
+
+    // One "width height" line per level, starting with the original
+    QList<QSize> levels;
+    while (!file.atEnd()) {
+        const auto parts = file.readLine().trimmed().split(' ');
+        if (parts.size() != 2) {
+            return {};
+        }
+        levels << QSize(parts.at(0).toInt(), parts.at(1).toInt());
+    }
+    return levels;
+}
+
+// The levels of a source below its original, which is never kept since requests that need it read the source
+struct Pyramid {
+    QSize original;
+    QList<QImage> levels; // Level i + 1, each half the size of the one above
+
+    [[nodiscard]] bool isValid() const {
+        return original.isValid();
+    }
+
+    [[nodiscard]] QList<QSize> sizes() const {
+        QList<QSize> sizes{ original };
+        for (const auto& level : levels) {
+            sizes << level.size();
+        }
+        return sizes;
+    }
+};
+
+// Pyramids that have been built but not written yet, so other sizes of the same source don't decode it again
+struct PendingPyramids {
+    QMutex mutex;
+    QHash<QString, Pyramid> pyramids;
+};
+
+PendingPyramids& pendingPyramids() {
+    static PendingPyramids pending;
+    return pending;
+}
+
+QThreadPool& writerPool() {
+    // Encoding is the slow part, a single low priority writer keeps it from competing with visible work
+    static QThreadPool pool;
+    [[maybe_unused]] static const bool initialised = []() {
+        pool.setMaxThreadCount(1);
+        pool.setThreadPriority(QThread::LowPriority);
+        return true;
+    }();
+    return pool;
+}
+
+Pyramid pendingPyramid(const QString& hash) {
+    auto& pending = pendingPyramids();
+    const QMutexLocker locker(&pending.mutex);
+    return pending.pyramids.value(hash);
+}
+
+// False if too many pyramids are already waiting to be written, the caller then doesn't queue another
+bool setPendingPyramid(const QString& hash, const Pyramid& pyramid) {
+    auto& pending = pendingPyramids();
+    const QMutexLocker locker(&pending.mutex);
+    if (pending.pyramids.size() >= MAX_PENDING_PYRAMIDS) {
+        return false;
+    }
+    pending.pyramids.insert(hash, pyramid);
+    return true;
+}
+
+void clearPendingPyramid(const QString& hash) {
+    auto& pending = pendingPyramids();
+    const QMutexLocker locker(&pending.mutex);
+    pending.pyramids.remove(hash);
+}
+
+Pyramid scalePyramid(const QImage& original) {
+    Pyramid pyramid{ original.size(), {} };
+    QImage previous = original;
+    while (qMax(previous.width(), previous.height()) > PREVIEW_SIZE && qMin(previous.width(), previous.height()) >= 2) {
+        previous = previous.scaled(previous.size() / 2, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        pyramid.levels << previous;
+    }
+    return pyramid;
+}
+
+void writePyramid(const Pyramid& pyramid, const QDir& dir, const QString& hash) {
+    QByteArray index = QString("%1 %2\n").arg(pyramid.original.width()).arg(pyramid.original.height()).toUtf8();
+
+    for (qsizetype i = 1; i <= pyramid.levels.size(); ++i) {
+        const QImage& level = pyramid.levels.at(i - 1);
+        if (!ImageCache::save(dir.filePath(mipFileName(hash, i)), level, MIP_QUALITY)) {
+            // Without an index the pyramid is rebuilt next time
+            qWarning() << "CachingImageManager::writePyramid: failed to save level" << i << "of" << hash;
+            return;
+        }
+        index += QString("%1 %2\n").arg(level.width()).arg(level.height()).toUtf8();
+    }
+
+    // Written last, so an existing index always refers to complete levels
+    QSaveFile file(dir.filePath(mipIndexFileName(hash)));
+    if (!dir.mkpath(".") || !file.open(QIODevice::WriteOnly) || file.write(index) != index.size() || !file.commit()) {
+        qWarning() << "CachingImageManager::writePyramid: failed to save index of" << hash;
+    }
+}
+
+qsizetype pickLevel(const QList<QSize>& levels, const QSize& size, const QString& fillMode) {
+    // Smallest level that still covers the requested size once scaled with the item's fill mode
+    const QSize needed = levels.first().scaled(size, aspectRatioMode(fillMode));
+    for (qsizetype i = levels.size() - 1; i > 0; --i) {
+        if (levels.at(i).width() >= needed.width() && levels.at(i).height() >= needed.height()) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+} // namespace
+
 qreal CachingImageManager::effectiveScale() const {
     if (m_item && m_item->window()) {
         return m_item->window()->devicePixelRatio();
@@ -105,11 +283,11 @@ void CachingImageManager::updateSource(const QString& path) {
 
     m_shaPath = path;
 
-    const auto future = QtConcurrent::run(&CachingImageManager::sha256sum, path);
+    const auto future = QtConcurrent::run(&CachingImageManager::inspect, path);
 
-    const auto watcher = new QFutureWatcher<QString>(this);
+    const auto watcher = new QFutureWatcher<Source>(this);
 
-    connect(watcher, &QFutureWatcher<QString>::finished, this, [watcher, path, this]() {
+    connect(watcher, &QFutureWatcher<Source>::finished, this, [watcher, path, this]() {
         if (m_path != path) {
             // Object is destroyed or path has changed, ignore
             watcher->deleteLater();
@@ -124,13 +302,17 @@ void CachingImageManager::updateSource(const QString& path) {
         }
 
         const QString fillMode = m_item->property("fillMode").toString();
-        // clang-format off
-        const QString filename = QString("%1@%2x%3-%4.png")
-            .arg(watcher->result()).arg(size.width()).arg(size.height())
-            .arg(fillMode == "PreserveAspectCrop" ? "crop" : fillMode == "PreserveAspectFit" ? "fit" : "stretch");
-        // clang-format on
+        const Source source = watcher->result();
+
+        if (source.animationSize.isValid()) {
+            // Never upscale, items can scale up at draw time for free
+            const QSize scaled = source.animationSize.scaled(size, aspectRatioMode(fillMode));
+            setFrameSize(scaled.width() < source.animationSize.width() ? scaled : source.animationSize);
+        } else {
+            setFrameSize(QSize());
+        }
 
-        const QUrl cache = m_cacheDir.resolved(QUrl(filename));
+        const QUrl cache = m_cacheDir.resolved(QUrl(cacheFileName(source.hash, size, fillMode)));
         if (m_cachePath == cache) {
             watcher->deleteLater();
             return;
@@ -145,12 +327,14 @@ void CachingImageManager::updateSource(const QString& path) {
             return;
         }
 
-        const QImageReader reader(cache.toLocalFile());
-        if (reader.canRead()) {
-            m_item->setProperty("source", cache);
+        const QString cacheFile = cache.toLocalFile();
+        if (!ImageCache::instance().find(cacheFile).isNull() || QImageReader(cacheFile).canRead()) {
+            m_item->setProperty("source", cacheSource(cacheFile));
         } else {
-            m_item->setProperty("source", QUrl::fromLocalFile(path));
-            createCache(path, cache.toLocalFile(), fillMode, size);
+            // Show a small preview until the entry is built, so the item never decodes the full size original itself
+            const QString preview = m_cacheDir.resolved(QUrl(previewFileName(source.hash))).toLocalFile();
+            createPreview(path, preview, cacheFile);
+            createCache(path, source.hash, cacheFile, fillMode, size);
         }
 
         // Clear current running sha if same
@@ -168,45 +352,246 @@ QUrl CachingImageManager::cachePath() const {
     return m_cachePath;
 }
 
-void CachingImageManager::createCache(
-    const QString& path, const QString& cache, const QString& fillMode, const QSize& size) const {
-    QThreadPool::globalInstance()->start([path, cache, fillMode, size] {
-        QImage image(path);
+bool CachingImageManager::animated() const {
+    return m_frameSize.isValid();
+}
 
-        if (image.isNull()) {
-            qWarning() << "CachingImageManager::createCache: failed to read" << path;
-            return;
+QSize CachingImageManager::frameSize() const {
+    return m_frameSize;
+}
+
+void CachingImageManager::setFrameSize(const QSize& frameSize) {
+    if (m_frameSize == frameSize) {
+        return;
+    }
+
+    m_frameSize = frameSize;
+    emit animationChanged();
+}
+
+CachingImageManager::Source CachingImageManager::inspect(const QString& path) {
+    QImageReader reader(path);
+
+    // GIFs always claim animation support, so single frame ones are told apart by their image count. An unknown
+    // count (0, or -1 on error) is treated as static, so the file is still cached rather than loaded at full size
+    QSize animationSize;
+    if (reader.supportsAnimation() && reader.imageCount() > 1) {
+        animationSize = reader.size();
+    }
+
+    return { sha256sum(path), animationSize };
+}
+
+QUrl CachingImageManager::cacheSource(const QString& cache) const {
+    // Serve through the shared decoded image cache so items showing the same cache entry don't decode it again
+    if (auto* engine = qmlEngine(this)) {
+        ImageCache::registerProvider(engine);
+        return ImageCache::providerUrl(cache);
+    }
+
+    return QUrl::fromLocalFile(cache);
+}
+
+void CachingImageManager::createPreview(const QString& path, const QString& preview, const QString& cache) {
+    const auto future = ImageCache::instance().build(preview, [path, preview]() {
+        return buildPreview(path, preview);
+    });
+
+    const auto watcher = new QFutureWatcher<QImage>(this);
+
+    connect(watcher, &QFutureWatcher<QImage>::finished, this, [preview, cache, watcher, this]() {
+        // Only show the preview while still waiting on the same entry, never replace the finished one
+        if (m_item && m_cachePath.toLocalFile() == cache && watcher->future().isResultReadyAt(0) &&
+            !watcher->result().isNull() && m_item->property("source").toUrl() != cacheSource(cache)) {
+            m_item->setProperty("source", cacheSource(preview));
         }
 
-        image.convertTo(QImage::Format_ARGB32);
+        watcher->deleteLater();
+    });
 
-        if (fillMode == "PreserveAspectCrop") {
-            image = image.scaled(size, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
-        } else if (fillMode == "PreserveAspectFit") {
-            image = image.scaled(size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-        } else {
-            image = image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    watcher->setFuture(future);
+}
+
+void CachingImageManager::createCache(
+    const QString& path, const QString& hash, const QString& cache, const QString& fillMode, const QSize& size) {
+    // Identical requests (other managers or quick path flips) attach to the job already in flight
+    const auto future = ImageCache::instance().build(cache, [path, hash, cache, fillMode, size]() {
+        return buildCache(path, hash, cache, fillMode, size);
+    });
+
+    const auto watcher = new QFutureWatcher<QImage>(this);
+
+    connect(watcher, &QFutureWatcher<QImage>::finished, this, [cache, watcher, this]() {
+        if (m_item && m_cachePath.toLocalFile() == cache && watcher->future().isResultReadyAt(0) &&
+            !watcher->result().isNull()) {
+            m_item->setProperty("source", cacheSource(cache));
         }
 
-        if (fillMode == "PreserveAspectCrop" || fillMode == "PreserveAspectFit") {
-            QImage canvas(size, QImage::Format_ARGB32);
-            canvas.fill(Qt::transparent);
+        watcher->deleteLater();
+    });
+
+    watcher->setFuture(future);
+}
+
+QString CachingImageManager::cacheFileName(const QString& hash, const QSize& size, const QString& fillMode) {
+    // clang-format off
+    return QString("%1@%2x%3-%4.png")
+        .arg(hash).arg(size.width()).arg(size.height())
+        .arg(fillMode == "PreserveAspectCrop" ? "crop" : fillMode == "PreserveAspectFit" ? "fit" : "stretch");
+    // clang-format on
+}
+
+QString CachingImageManager::previewFileName(const QString& hash) {
+    return QString("%1@preview.png").arg(hash);
+}
+
+QImage CachingImageManager::buildPreview(const QString& path, const QString& preview) {
+    if (QFileInfo::exists(preview)) {
+        return ImageCache::instance().load(preview);
+    }
+
+    // Decoders that support it (e.g. JPEG) scale while decoding, so this is much cheaper than a full read
+    QImageReader reader(path);
+    const QSize size = reader.size();
+    if (size.isValid()) {
+        reader.setScaledSize(size.scaled(PREVIEW_SIZE, PREVIEW_SIZE, Qt::KeepAspectRatio));
+    }
+
+    QImage image = reader.read();
+    if (image.isNull()) {
+        qWarning() << "CachingImageManager::buildPreview: failed to read" << path << "-" << reader.errorString();
+        return image;
+    }
 
-            QPainter painter(&canvas);
-            painter.drawImage((size.width() - image.width()) / 2, (size.height() - image.height()) / 2, image);
-            painter.end();
+    if (!size.isValid()) {
+        image = image.scaled(PREVIEW_SIZE, PREVIEW_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
 
-            image = canvas;
+    if (!ImageCache::save(preview, image)) {
+        qWarning() << "CachingImageManager::buildPreview: failed to save to" << preview;
+    }
+
+    ImageCache::instance().insert(preview, image);
+    return image;
+}
+
+QImage CachingImageManager::buildCache(const QString& path, const QString& hash, const QString& cache,
+    const QString& fillMode, const QSize& size, bool forDisplay) {
+    const QDir dir = QFileInfo(cache).dir();
+    QImage image;
+
+    QMutexLocker locker(&pyramidMutex(hash));
+    Pyramid pyramid = pendingPyramid(hash);
+    QList<QSize> levels = pyramid.isValid() ? pyramid.sizes() : readPyramid(dir.filePath(mipIndexFileName(hash)));
+
+    QImage original;
+    if (levels.isEmpty()) {
+        // First request for this source, decode it once and derive from the in memory levels. Animated sources are
+        // cached as their first frame, a poster for items that play them
+        original = QImage(path);
+        if (original.isNull()) {
+            qWarning() << "CachingImageManager::buildCache: failed to read" << path;
+            return original;
         }
 
-        const QString parent = QFileInfo(cache).absolutePath();
-        if (!QDir().mkpath(parent) || !image.save(cache)) {
-            qWarning() << "CachingImageManager::createCache: failed to save to" << cache;
+        original.convertTo(QImage::Format_ARGB32);
+        pyramid = scalePyramid(original);
+        levels = pyramid.sizes();
+
+        // Written outside the lock, requests for the same source use the in memory levels until it is done
+        const bool pending = setPendingPyramid(hash, pyramid);
+        locker.unlock();
+
+        if (!forDisplay) {
+            // Nobody is waiting on the entry, and writing inline keeps a backlog of decoded pyramids from piling up
+            writePyramid(pyramid, dir, hash);
+            if (pending) {
+                clearPendingPyramid(hash);
+            }
+        } else if (pending) {
+            // Writing every level would hold up the entry that was asked for, so it happens once that is returned.
+            // With the writer backlog full it is skipped, a later request builds the pyramid again
+            writerPool().start([pyramid, dir, hash]() {
+                writePyramid(pyramid, dir, hash);
+                clearPendingPyramid(hash);
+            });
         }
-    });
+    } else {
+        locker.unlock();
+    }
+
+    // Levels only exist below the original size, larger requests still need the original
+    const qsizetype level = pickLevel(levels, size, fillMode);
+    if (level > 0) {
+        image = pyramid.isValid() ? pyramid.levels.at(level - 1) : QImage(dir.filePath(mipFileName(hash, level)));
+    }
+    if (image.isNull()) {
+        image = original.isNull() ? QImage(path) : original;
+    }
+
+    if (image.isNull()) {
+        qWarning() << "CachingImageManager::buildCache: failed to read" << path;
+        return image;
+    }
+
+    image.convertTo(QImage::Format_ARGB32);
+
+    image = image.scaled(size, aspectRatioMode(fillMode), Qt::SmoothTransformation);
+
+    if (fillMode == "PreserveAspectCrop" || fillMode == "PreserveAspectFit") {
+        QImage canvas(size, QImage::Format_ARGB32);
+        canvas.fill(Qt::transparent);
+
+        QPainter painter(&canvas);
+        painter.drawImage((size.width() - image.width()) / 2, (size.height() - image.height()) / 2, image);
+        painter.end();
+
+        image = canvas;
+    }
+
+    if (!ImageCache::save(cache, image)) {
+        qWarning() << "CachingImageManager::buildCache: failed to save to" << cache;
+    }
+
+    if (forDisplay) {
+        ImageCache::instance().insert(cache, image);
+    }
+    return image;
+}
+
+QImage CachingImageManager::findMipLevel(const QString& cacheDir, const QString& path, int minSize) {
+    const QString hash = sha256sum(path);
+    if (hash.isEmpty()) {
+        return QImage();
+    }
+
+    const QDir dir(cacheDir);
+    const QList<QSize> levels = readPyramid(dir.filePath(mipIndexFileName(hash)));
+
+    qsizetype level = 0;
+    for (qsizetype i = 1; i < levels.size(); ++i) {
+        if (qMax(levels.at(i).width(), levels.at(i).height()) >= minSize) {
+            level = i;
+        }
+    }
+
+    return level > 0 ? QImage(dir.filePath(mipFileName(hash, level))) : QImage();
 }
 
 QString CachingImageManager::sha256sum(const QString& path) {
+    const QFileInfo info(path);
+    const qint64 size = info.size();
+    const QDateTime modified = info.lastModified();
+
+    auto& memo = hashMemo();
+    {
+        const QMutexLocker locker(&memo.mutex);
+        if (const auto it = memo.files.constFind(path);
+            it != memo.files.cend() && it->size == size && it->modified == modified) {
+            return it->hash;
+        }
+    }
+
     QFile file(path);
     if (!file.open(QIODevice::ReadOnly)) {
         qWarning() << "CachingImageManager::sha256sum: failed to open" << path;
@@ -217,7 +602,10 @@ QString CachingImageManager::sha256sum(const QString& path) {
     hash.addData(&file);
     file.close();
 
-    return hash.result().toHex();
+    const QString result = hash.result().toHex();
+    const QMutexLocker locker(&memo.mutex);
+    memo.files.insert(path, { size, modified, result });
+    return result;
 }
 
 } // namespace caelestia::internal
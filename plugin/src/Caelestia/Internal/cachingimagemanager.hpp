@@ -15,6 +15,10 @@ class CachingImageManager : public QObject {
 
     Q_PROPERTY(QString path READ path WRITE setPath NOTIFY pathChanged)
     Q_PROPERTY(QUrl cachePath READ cachePath NOTIFY cachePathChanged)
+    // The cache only holds the first frame of animated sources, items that want to play them decode frames at
+    // frameSize, the source scaled with the item's fill mode to its size in device pixels
+    Q_PROPERTY(bool animated READ animated NOTIFY animationChanged)
+    Q_PROPERTY(QSize frameSize READ frameSize NOTIFY animationChanged)
 
 public:
     explicit CachingImageManager(QObject* parent = nullptr)
@@ -32,9 +36,26 @@ public:
 
     [[nodiscard]] QUrl cachePath() const;
 
+    [[nodiscard]] bool animated() const;
+    [[nodiscard]] QSize frameSize() const;
+
     Q_INVOKABLE void updateSource();
     Q_INVOKABLE void updateSource(const QString& path);
 
+    [[nodiscard]] static QString cacheFileName(const QString& hash, const QSize& size, const QString& fillMode);
+    [[nodiscard]] static QString previewFileName(const QString& hash);
+    [[nodiscard]] static QImage buildPreview(const QString& path, const QString& preview);
+    // Derives the entry from the nearest larger level of the source's mip pyramid, building it on first use. Entries
+    // for display return before the pyramid is written and are kept decoded. Others (e.g. prewarmed ones) write it
+    // inline and skip the decoded image cache, so they don't evict visible ones
+    [[nodiscard]] static QImage buildCache(const QString& path, const QString& hash, const QString& cache,
+        const QString& fillMode, const QSize& size, bool forDisplay = true);
+    // Remembered per path until the file's size or mtime changes
+    [[nodiscard]] static QString sha256sum(const QString& path);
+    // Smallest level of the source's mip pyramid in cacheDir whose longer side is at least minSize. Null if there is
+    // no pyramid yet or only the original is large enough
+    [[nodiscard]] static QImage findMipLevel(const QString& cacheDir, const QString& path, int minSize);
+
 signals:
     void itemChanged();
     void cacheDirChanged();
@@ -42,8 +63,14 @@ signals:
     void pathChanged();
     void cachePathChanged();
     void usingCacheChanged();
+    void animationChanged();
 
 private:
+    struct Source {
+        QString hash;
+        QSize animationSize; // Full frame size of an animated source, invalid if it is static
+    };
+
     QString m_shaPath;
 
     QQuickItem* m_item;
@@ -51,15 +78,21 @@ private:
 
     QString m_path;
     QUrl m_cachePath;
+    QSize m_frameSize;
 
     QMetaObject::Connection m_widthConn;
     QMetaObject::Connection m_heightConn;
 
     [[nodiscard]] qreal effectiveScale() const;
     [[nodiscard]] QSize effectiveSize() const;
+    [[nodiscard]] QUrl cacheSource(const QString& cache) const;
+    [[nodiscard]] static Source inspect(const QString& path);
 
-    void createCache(const QString& path, const QString& cache, const QString& fillMode, const QSize& size) const;
-    [[nodiscard]] static QString sha256sum(const QString& path);
+    void setFrameSize(const QSize& frameSize);
+
+    void createPreview(const QString& path, const QString& preview, const QString& cache);
+    void createCache(
+        const QString& path, const QString& hash, const QString& cache, const QString& fillMode, const QSize& size);
 };
 
 } // namespace caelestia::internal
@@ -0,0 +1,240 @@
+#include "cachingimageprewarmer.hpp"
+
+#include "cachingimagemanager.hpp"
+#include "imagecache.hpp"
+#include "iopriority.hpp"
+#include <qdir.h>
+#include <qfile.h>
+#include <qtconcurrentrun.h>
+
+namespace caelestia::internal {
+
+namespace {
+
+QString fillModeName(int fillMode) {
+    // Matches the Image.FillMode keys CachingImageManager reads from its item
+    switch (fillMode) {
+    case 1:
+        return "PreserveAspectFit";
+    case 2:
+        return "PreserveAspectCrop";
+    default:
+        return "Stretch";
+    }
+}
+
+} // namespace
+
+CachingImagePrewarmer::CachingImagePrewarmer(QObject* parent)
+    : QObject(parent)
+    , m_canceled(std::make_shared<std::atomic_bool>(false))
+    , m_fillMode(2)
+    , m_running(false)
+    , m_total(0)
+    , m_completed(0) {
+    m_pool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() / 2));
+    m_pool.setThreadPriority(QThread::IdlePriority);
+}
+
+CachingImagePrewarmer::~CachingImagePrewarmer() {
+    // Queued jobs bail out early, the pool then waits for the running ones on destruction
+    *m_canceled = true;
+}
+
+QUrl CachingImagePrewarmer::cacheDir() const {
+    return m_cacheDir;
+}
+
+void CachingImagePrewarmer::setCacheDir(const QUrl& cacheDir) {
+    if (m_cacheDir == cacheDir) {
+        return;
+    }
+
+    m_cacheDir = cacheDir;
+    emit cacheDirChanged();
+
+    cancel();
+}
+
+QSize CachingImagePrewarmer::size() const {
+    return m_size;
+}
+
+void CachingImagePrewarmer::setSize(const QSize& size) {
+    if (m_size == size) {
+        return;
+    }
+
+    m_size = size;
+    emit sizeChanged();
+
+    cancel();
+}
+
+int CachingImagePrewarmer::fillMode() const {
+    return m_fillMode;
+}
+
+void CachingImagePrewarmer::setFillMode(int fillMode) {
+    if (m_fillMode == fillMode) {
+        return;
+    }
+
+    m_fillMode = fillMode;
+    emit fillModeChanged();
+
+    cancel();
+}
+
+int CachingImagePrewarmer::maxThreads() const {
+    return m_pool.maxThreadCount();
+}
+
+void CachingImagePrewarmer::setMaxThreads(int maxThreads) {
+    maxThreads = qMax(1, maxThreads);
+    if (m_pool.maxThreadCount() == maxThreads) {
+        return;
+    }
+
+    m_pool.setMaxThreadCount(maxThreads);
+    emit maxThreadsChanged();
+}
+
+bool CachingImagePrewarmer::running() const {
+    return m_running;
+}
+
+int CachingImagePrewarmer::total() const {
+    return m_total;
+}
+
+int CachingImagePrewarmer::completed() const {
+    return m_completed;
+}
+
+qreal CachingImagePrewarmer::progress() const {
+    return m_total > 0 ? static_cast<qreal>(m_completed) / m_total : 0.0;
+}
+
+void CachingImagePrewarmer::prewarm(const QStringList& paths) {
+    if (!m_cacheDir.isLocalFile()) {
+        qWarning() << "CachingImagePrewarmer::prewarm: cacheDir" << m_cacheDir << "is not a local file";
+        return;
+    }
+
+    if (m_size.isEmpty()) {
+        return;
+    }
+
+    QStringList added;
+    for (const auto& path : paths) {
+        if (!m_queued.contains(path)) {
+            m_queued << path;
+            added << path;
+        }
+    }
+
+    if (added.isEmpty()) {
+        return;
+    }
+
+    // Joins the run in progress, if any
+    if (!m_running) {
+        m_total = 0;
+        m_completed = 0;
+    }
+    m_total += static_cast<int>(added.size());
+    emit progressChanged();
+    setRunning(true);
+
+    const auto canceled = m_canceled;
+    const QDir dir(m_cacheDir.toLocalFile());
+    const QSize size = m_size;
+    const QString fillMode = fillModeName(m_fillMode);
+
+    for (const auto& path : std::as_const(added)) {
+        // Resolves to the source hash and cache path, or empty strings if nothing needs building
+        QtConcurrent::run(&m_pool, [canceled, dir, size, fillMode, path]() {
+            if (*canceled) {
+                return QPair<QString, QString>();
+            }
+
+            setIdleIoPriority();
+
+            const QString hash = CachingImageManager::sha256sum(path);
+            if (hash.isEmpty()) {
+                return QPair<QString, QString>();
+            }
+
+            // Cache files are renamed into place once complete, so existence means a usable entry
+            const QString cache = dir.filePath(CachingImageManager::cacheFileName(hash, size, fillMode));
+            if (!ImageCache::instance().find(cache).isNull() || QFile::exists(cache)) {
+                return QPair<QString, QString>();
+            }
+
+            return qMakePair(hash, cache);
+        }).then(this, [canceled, size, fillMode, path, this](const QPair<QString, QString>& result) {
+            if (*canceled) {
+                return;
+            }
+
+            const QString hash = result.first;
+            const QString cache = result.second;
+            if (cache.isEmpty()) {
+                advance();
+                return;
+            }
+
+            // Kept out of ImageCache's shared jobs, a visible item asking for the same entry must not wait behind the
+            // idle queue or get nothing back when prewarming is canceled. At worst both build it, the files are
+            // replaced atomically so either result is fine
+            QtConcurrent::run(&m_pool, [canceled, size, fillMode, path, hash, cache]() {
+                if (*canceled || QFile::exists(cache)) {
+                    return;
+                }
+
+                setIdleIoPriority();
+                [[maybe_unused]] const auto image =
+                    CachingImageManager::buildCache(path, hash, cache, fillMode, size, false);
+            }).then(this, [canceled, this]() {
+                if (!*canceled) {
+                    advance();
+                }
+            });
+        });
+    }
+}
+
+void CachingImagePrewarmer::cancel() {
+    // Canceled jobs may not have run, so everything is queued again next time. Hashes are remembered, which makes
+    // that cheap for entries that were already built
+    m_queued.clear();
+
+    if (!m_running) {
+        return;
+    }
+
+    *m_canceled = true;
+    m_canceled = std::make_shared<std::atomic_bool>(false);
+
+    setRunning(false);
+}
+
+void CachingImagePrewarmer::advance() {
+    ++m_completed;
+    emit progressChanged();
+
+    if (m_completed >= m_total) {
+        setRunning(false);
+        emit finished();
+    }
+}
+
+void CachingImagePrewarmer::setRunning(bool running) {
+    if (m_running != running) {
+        m_running = running;
+        emit runningChanged();
+    }
+}
+
+} // namespace caelestia::internal
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <qobject.h>
+#include <qqmlintegration.h>
+#include <qset.h>
+#include <qsize.h>
+#include <qthreadpool.h>
+#include <qurl.h>
+
+namespace caelestia::internal {
+
+class CachingImagePrewarmer : public QObject {
+    Q_OBJECT
+    QML_ELEMENT
+
+    Q_PROPERTY(QUrl cacheDir READ cacheDir WRITE setCacheDir NOTIFY cacheDirChanged REQUIRED)
+    // Size in device pixels and Image.FillMode, as the CachingImageManager of the displaying item would compute
+    Q_PROPERTY(QSize size READ size WRITE setSize NOTIFY sizeChanged)
+    Q_PROPERTY(int fillMode READ fillMode WRITE setFillMode NOTIFY fillModeChanged)
+    Q_PROPERTY(int maxThreads READ maxThreads WRITE setMaxThreads NOTIFY maxThreadsChanged)
+
+    Q_PROPERTY(bool running READ running NOTIFY runningChanged)
+    Q_PROPERTY(int total READ total NOTIFY progressChanged)
+    Q_PROPERTY(int completed READ completed NOTIFY progressChanged)
+    Q_PROPERTY(qreal progress READ progress NOTIFY progressChanged)
+
+public:
+    explicit CachingImagePrewarmer(QObject* parent = nullptr);
+    ~CachingImagePrewarmer();
+
+    [[nodiscard]] QUrl cacheDir() const;
+    void setCacheDir(const QUrl& cacheDir);
+
+    [[nodiscard]] QSize size() const;
+    void setSize(const QSize& size);
+
+    [[nodiscard]] int fillMode() const;
+    void setFillMode(int fillMode);
+
+    [[nodiscard]] int maxThreads() const;
+    void setMaxThreads(int maxThreads);
+
+    [[nodiscard]] bool running() const;
+    [[nodiscard]] int total() const;
+    [[nodiscard]] int completed() const;
+    [[nodiscard]] qreal progress() const;
+
+    // Queues the paths that haven't been queued since the last cancel or settings change, so it can be called with a
+    // whole library whenever it changes
+    Q_INVOKABLE void prewarm(const QStringList& paths);
+    Q_INVOKABLE void cancel();
+
+signals:
+    void cacheDirChanged();
+    void sizeChanged();
+    void fillModeChanged();
+    void maxThreadsChanged();
+    void runningChanged();
+    void progressChanged();
+    void finished();
+
+private:
+    QThreadPool m_pool;
+    std::shared_ptr<std::atomic_bool> m_canceled;
+
+    QUrl m_cacheDir;
+    QSize m_size;
+    int m_fillMode;
+
+    // Paths queued with the current settings, cleared when they change or the run is canceled
+    QSet<QString> m_queued;
+
+    bool m_running;
+    int m_total;
+    int m_completed;
+
+    void advance();
+    void setRunning(bool running);
+};
+
+} // namespace caelestia::internal
@@ -0,0 +1,122 @@
+#include "imagecache.hpp"
+
+#include <qdir.h>
+#include <qfileinfo.h>
+#include <qimagereader.h>
+#include <qqmlengine.h>
+#include <qsavefile.h>
+#include <qtconcurrentrun.h>
+
+namespace caelestia::internal {
+
+namespace {
+
+constexpr auto PROVIDER_ID = "cachingimage";
+constexpr qsizetype MEMORY_BUDGET = 128 * 1024 * 1024; // Bytes of decoded pixels
+
+} // namespace
+
+ImageCache::ImageCache()
+    : m_images(MEMORY_BUDGET) {}
+
+ImageCache& ImageCache::instance() {
+    static ImageCache instance;
+    return instance;
+}
+
+QImage ImageCache::load(const QString& path) {
+    if (const auto image = find(path); !image.isNull()) {
+        return image;
+    }
+
+    QImageReader reader(path);
+    const QImage image = reader.read();
+    if (image.isNull()) {
+        qWarning() << "ImageCache::load: failed to read" << path << "-" << reader.errorString();
+        return image;
+    }
+
+    insert(path, image);
+    return image;
+}
+
+QImage ImageCache::find(const QString& path) const {
+    const QMutexLocker locker(&m_mutex);
+    if (const auto* image = m_images.object(path)) {
+        return *image;
+    }
+    return QImage();
+}
+
+void ImageCache::insert(const QString& path, const QImage& image) {
+    if (image.isNull()) {
+        return;
+    }
+
+    const QMutexLocker locker(&m_mutex);
+    // Images larger than the whole budget are rejected (and deleted) by QCache
+    m_images.insert(path, new QImage(image), image.sizeInBytes());
+}
+
+QFuture<QImage> ImageCache::build(const QString& key, const std::function<QImage()>& job, QThreadPool* pool) {
+    QMutexLocker locker(&m_mutex);
+
+    if (const auto it = m_jobs.constFind(key); it != m_jobs.cend()) {
+        return *it;
+    }
+
+    auto future = QtConcurrent::run(pool, job);
+    m_jobs.insert(key, future);
+    locker.unlock();
+
+    // May run synchronously if the job has already finished, so the lock must be released first
+    future.then([key, this](const QImage&) {
+        const QMutexLocker jobsLocker(&m_mutex);
+        m_jobs.remove(key);
+    });
+
+    return future;
+}
+
+bool ImageCache::save(const QString& path, const QImage& image, int quality) {
+    QSaveFile file(path);
+    return QDir().mkpath(QFileInfo(path).absolutePath()) && file.open(QIODevice::WriteOnly) &&
+           image.save(&file, "PNG", quality) && file.commit();
+}
+
+QUrl ImageCache::providerUrl(const QString& path) {
+    QUrl url;
+    url.setScheme("image");
+    url.setHost(PROVIDER_ID);
+    url.setPath(path);
+    return url;
+}
+
+QString ImageCache::providerPath(const QUrl& url) {
+    if (url.scheme() != "image" || url.host() != PROVIDER_ID) {
+        return QString();
+    }
+    return url.path(QUrl::FullyDecoded);
+}
+
+void ImageCache::registerProvider(QQmlEngine* engine) {
+    if (engine && !engine->imageProvider(PROVIDER_ID)) {
+        engine->addImageProvider(PROVIDER_ID, new CachingImageProvider);
+    }
+}
+
+CachingImageProvider::CachingImageProvider()
+    : QQuickImageProvider(QQuickImageProvider::Image) {}
+
+QImage CachingImageProvider::requestImage(const QString& id, QSize* size, const QSize& requestedSize) {
+    Q_UNUSED(requestedSize);
+
+    // The id is the cache path without its leading slash, still encoded for reserved characters
+    const QImage image = ImageCache::instance().load(QUrl::fromPercentEncoding(("/" + id).toUtf8()));
+    if (size) {
+        *size = image.size();
+    }
+    return image;
+}
+
+} // namespace caelestia::internal
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <QtQuick/qquickimageprovider.h>
+#include <functional>
+#include <qcache.h>
+#include <qfuture.h>
+#include <qhash.h>
+#include <qimage.h>
+#include <qmutex.h>
+#include <qthreadpool.h>
+#include <qurl.h>
+
+namespace caelestia::internal {
+
+class ImageCache {
+public:
+    ImageCache(const ImageCache&) = delete;
+    ImageCache& operator=(const ImageCache&) = delete;
+
+    static ImageCache& instance();
+
+    // Returns the decoded image for the given cache file, decoding and storing it on a miss
+    [[nodiscard]] QImage load(const QString& path);
+    [[nodiscard]] QImage find(const QString& path) const;
+    void insert(const QString& path, const QImage& image);
+
+    // Runs job on pool unless a job for key is already in flight, in which case that one is shared
+    [[nodiscard]] QFuture<QImage> build(const QString& key, const std::function<QImage()>& job,
+        QThreadPool* pool = QThreadPool::globalInstance());
+
+    // Writes image as a PNG through a temporary file, so readers never see a partially written file
+    static bool save(const QString& path, const QImage& image, int quality = -1);
+
+    [[nodiscard]] static QUrl providerUrl(const QString& path);
+    // The cache file a providerUrl serves, or an empty string for any other url
+    [[nodiscard]] static QString providerPath(const QUrl& url);
+    static void registerProvider(QQmlEngine* engine);
+
+private:
+    ImageCache();
+
+    mutable QMutex m_mutex;
+    QCache<QString, QImage> m_images;
+    QHash<QString, QFuture<QImage>> m_jobs;
+};
+
+class CachingImageProvider : public QQuickImageProvider {
+public:
+    explicit CachingImageProvider();
+
+    QImage requestImage(const QString& id, QSize* size, const QSize& requestedSize) override;
+};
+
+} // namespace caelestia::internal
@@ -0,0 +1,30 @@
+#include "iopriority.hpp"
+
+#include <qdebug.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace caelestia::internal {
+
+namespace {
+
+constexpr int IOPRIO_WHO_PROCESS = 1;
+constexpr int IOPRIO_CLASS_IDLE = 3;
+constexpr int IOPRIO_CLASS_SHIFT = 13;
+
+} // namespace
+
+void setIdleIoPriority() {
+    thread_local bool isIdle = false;
+    if (isIdle) {
+        return;
+    }
+
+    // A who of 0 targets the calling thread, so only the pool's own threads are affected
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+        qWarning() << "setIdleIoPriority: failed to set idle io priority";
+    }
+    isIdle = true;
+}
+
+} // namespace caelestia::internal
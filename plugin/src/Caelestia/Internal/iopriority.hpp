@@ -0,0 +1,9 @@
+#pragma once
+
+namespace caelestia::internal {
+
+// Moves the calling thread to the idle io class, so background work only gets the disk when nothing else wants it.
+// Meant for threads of a dedicated pool, it is only done once per thread
+void setIdleIoPriority();
+
+} // namespace caelestia::internal
@@ -0,0 +1,175 @@
+#include "directorysnapshot.hpp"
+
+#include <algorithm>
+#include <qcryptographichash.h>
+#include <qdatastream.h>
+#include <qdir.h>
+#include <qfile.h>
+#include <qfileinfo.h>
+#include <qsavefile.h>
+#include <qstandardpaths.h>
+#include <sys/stat.h>
+
+namespace caelestia::models {
+
+namespace {
+
+constexpr quint32 FILE_MAGIC = 0x43444952; // "CDIR"
+// Bump whenever the layout changes, old snapshots are then ignored and replaced by the next walk
+constexpr quint32 FILE_VERSION = 1;
+
+// Smallest size each record can take in the stream, i.e. with empty names
+constexpr qint64 MIN_DIR_SIZE = 20;
+constexpr qint64 MIN_SUBDIR_SIZE = 4;
+constexpr qint64 MIN_ENTRY_SIZE = 5;
+
+// Names are stored relative to their directory and as raw file name bytes, which keeps the file compact
+QByteArray encodeName(const QString& dir, const QString& path) {
+    return QFile::encodeName(path.sliced(dir.size() + 1));
+}
+
+QString decodeName(const QString& dir, const QByteArray& name) {
+    return dir + '/' + QFile::decodeName(name);
+}
+
+// Counts are read from the file, so a corrupt one must not reserve more records than the rest of it could hold
+qsizetype reservableCount(const QDataStream& stream, quint32 count, qint64 recordSize) {
+    return static_cast<qsizetype>(std::min<qint64>(count, stream.device()->bytesAvailable() / recordSize));
+}
+
+} // namespace
+
+qsizetype DirectorySnapshot::entryCount() const {
+    qsizetype count = 0;
+    for (const auto& dir : dirs) {
+        count += dir.entries.size();
+    }
+    return count;
+}
+
+QList<DirectoryWalker::Entry> DirectorySnapshot::entries() const {
+    QList<DirectoryWalker::Entry> all;
+    all.reserve(entryCount());
+    for (const auto& dir : dirs) {
+        all << dir.entries;
+    }
+    return all;
+}
+
+std::optional<DirectorySnapshot> DirectorySnapshot::load(const QString& key) {
+    QFile file(filePath(key));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return std::nullopt;
+    }
+
+    // Read straight from the page cache rather than copied into a buffer first
+    const qint64 size = file.size();
+    const uchar* data = size > 0 ? file.map(0, size) : nullptr;
+    if (!data) {
+        return std::nullopt;
+    }
+
+    const auto bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(data), static_cast<qsizetype>(size));
+    QDataStream stream(bytes);
+    stream.setVersion(QDataStream::Qt_6_0);
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    QString storedKey;
+    stream >> magic >> version >> storedKey;
+
+    // The file name is only a hash, so the full key guards against collisions
+    if (stream.status() != QDataStream::Ok || magic != FILE_MAGIC || version != FILE_VERSION || storedKey != key) {
+        return std::nullopt;
+    }
+
+    DirectorySnapshot snapshot;
+    quint32 dirCount = 0;
+    stream >> dirCount;
+    snapshot.dirs.reserve(reservableCount(stream, dirCount, MIN_DIR_SIZE));
+
+    for (quint32 i = 0; i < dirCount && stream.status() == QDataStream::Ok; ++i) {
+        QByteArray path;
+        Directory dir;
+        quint32 subdirCount = 0;
+        stream >> path >> dir.mtime >> subdirCount;
+
+        const QString dirPath = QFile::decodeName(path);
+        dir.subdirs.reserve(reservableCount(stream, subdirCount, MIN_SUBDIR_SIZE));
+        for (quint32 j = 0; j < subdirCount && stream.status() == QDataStream::Ok; ++j) {
+            QByteArray name;
+            stream >> name;
+            dir.subdirs << decodeName(dirPath, name);
+        }
+
+        quint32 count = 0;
+        stream >> count;
+        dir.entries.reserve(reservableCount(stream, count, MIN_ENTRY_SIZE));
+        for (quint32 j = 0; j < count && stream.status() == QDataStream::Ok; ++j) {
+            QByteArray name;
+            bool isDir = false;
+            stream >> name >> isDir;
+            dir.entries << DirectoryWalker::Entry{ decodeName(dirPath, name), isDir };
+        }
+
+        snapshot.dirs.insert(dirPath, std::move(dir));
+    }
+
+    if (stream.status() != QDataStream::Ok) {
+        qWarning() << "DirectorySnapshot::load: ignoring truncated snapshot" << file.fileName();
+        return std::nullopt;
+    }
+
+    return snapshot;
+}
+
+void DirectorySnapshot::save(const QString& key) const {
+    const QString path = filePath(key);
+    if (!QDir().mkpath(QFileInfo(path).path())) {
+        qWarning() << "DirectorySnapshot::save: failed to create cache dir" << QFileInfo(path).path();
+        return;
+    }
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "DirectorySnapshot::save: failed to open" << path << "-" << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << FILE_MAGIC << FILE_VERSION << key << static_cast<quint32>(dirs.size());
+
+    for (auto it = dirs.cbegin(); it != dirs.cend(); ++it) {
+        const auto& dir = it.value();
+        stream << QFile::encodeName(it.key()) << dir.mtime << static_cast<quint32>(dir.subdirs.size());
+        for (const auto& subdir : dir.subdirs) {
+            stream << encodeName(it.key(), subdir);
+        }
+
+        stream << static_cast<quint32>(dir.entries.size());
+        for (const auto& entry : dir.entries) {
+            stream << encodeName(it.key(), entry.path) << entry.isDir;
+        }
+    }
+
+    if (!file.commit()) {
+        qWarning() << "DirectorySnapshot::save: failed to write" << path << "-" << file.errorString();
+    }
+}
+
+qint64 DirectorySnapshot::mtime(const QString& dir) {
+    struct stat st;
+    if (stat(QFile::encodeName(dir).constData(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    return static_cast<qint64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+QString DirectorySnapshot::filePath(const QString& key) {
+    const auto hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/caelestia/filesystemmodel/" +
+           QString::fromLatin1(hash) + ".bin";
+}
+
+} // namespace caelestia::models
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "directorywalker.hpp"
+#include <optional>
+#include <qhash.h>
+#include <qlist.h>
+#include <qstring.h>
+
+namespace caelestia::models {
+
+// The result of a walk as it was last seen, kept on disk so a model can show it before walking again. Each directory
+// records its mtime, so only directories that have since gained or lost entries need to be listed again
+class DirectorySnapshot {
+public:
+    struct Directory {
+        qint64 mtime = 0; // ns
+        QStringList subdirs;
+        QList<DirectoryWalker::Entry> entries;
+    };
+
+    // Listed directories by absolute path. A directory that failed to list has no record
+    QHash<QString, Directory> dirs;
+
+    [[nodiscard]] qsizetype entryCount() const;
+    [[nodiscard]] QList<DirectoryWalker::Entry> entries() const;
+
+    // key identifies the walk, i.e. its root and everything deciding which entries it accepts. Loading maps the file,
+    // saving replaces it in one go, both are meant for the thread doing the walk
+    [[nodiscard]] static std::optional<DirectorySnapshot> load(const QString& key);
+    void save(const QString& key) const;
+
+    // Mtime in ns of a directory as the walker records it, -1 if it can't be stat'ed
+    [[nodiscard]] static qint64 mtime(const QString& dir);
+
+private:
+    [[nodiscard]] static QString filePath(const QString& key);
+};
+
+} // namespace caelestia::models
@@ -0,0 +1,241 @@
+#include "directorywalker.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <qdir.h>
+#include <qelapsedtimer.h>
+#include <qfile.h>
+#include <qmutex.h>
+#include <qsemaphore.h>
+#include <qthreadpool.h>
+#include <qwaitcondition.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+
+namespace caelestia::models {
+
+namespace {
+
+constexpr qsizetype CHUNK_SIZE = 256;
+constexpr qint64 CHUNK_INTERVAL = 16; // ms
+constexpr std::size_t BUFFER_SIZE = 32 * 1024;
+constexpr int MAX_THREADS = 8;
+
+QThreadPool& pool() {
+    static QThreadPool pool;
+    [[maybe_unused]] static const bool initialised = []() {
+        pool.setMaxThreadCount(qBound(2, QThread::idealThreadCount(), MAX_THREADS));
+        return true;
+    }();
+    return pool;
+}
+
+struct WalkState {
+    const bool recursive;
+    const bool showHidden;
+    const DirectoryWalker::Predicate& accept;
+    const std::function<bool()>& isCanceled;
+    const DirectoryWalker::ChunkHandler& onChunk;
+    const DirectoryWalker::DirectoryHandler& onDirectory;
+
+    QMutex mutex;
+    QWaitCondition wake;
+    QStringList pending;
+    int active = 0;
+    int listed = 0;
+    int discovered = 1;
+
+    QMutex chunkMutex;
+};
+
+class ChunkBuffer {
+public:
+    explicit ChunkBuffer(WalkState& state)
+        : m_state(state) {
+        m_timer.start();
+    }
+
+    void append(DirectoryWalker::Entry&& entry) {
+        m_entries << std::move(entry);
+        if (m_entries.size() >= CHUNK_SIZE || m_timer.hasExpired(CHUNK_INTERVAL)) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (!m_entries.isEmpty()) {
+            qreal progress;
+            {
+                QMutexLocker locker(&m_state.mutex);
+                progress = static_cast<qreal>(m_state.listed) / static_cast<qreal>(m_state.discovered);
+            }
+
+            QMutexLocker locker(&m_state.chunkMutex);
+            m_state.onChunk(std::exchange(m_entries, {}), progress);
+        }
+        m_timer.restart();
+    }
+
+    [[nodiscard]] bool isEmpty() const { return m_entries.isEmpty(); }
+
+private:
+    WalkState& m_state;
+    QList<DirectoryWalker::Entry> m_entries;
+    QElapsedTimer m_timer;
+};
+
+// Returns whether the directory was listed in full
+bool listDirectory(const QString& dir, WalkState& state, ChunkBuffer& chunk, QStringList& subdirs, qint64& mtime) {
+    const int fd = open(QFile::encodeName(dir).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    // Taken before listing, so a change made while listing makes the recorded mtime stale rather than the listing
+    struct stat dirStat;
+    if (fstat(fd, &dirStat) == -1) {
+        close(fd);
+        return false;
+    }
+    mtime = static_cast<qint64>(dirStat.st_mtim.tv_sec) * 1000000000 + dirStat.st_mtim.tv_nsec;
+
+    bool complete = false;
+    alignas(dirent64) char buffer[BUFFER_SIZE];
+    for (;;) {
+        const long length = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            complete = length == 0;
+            break;
+        }
+
+        for (long offset = 0; offset < length;) {
+            const auto* dirent = reinterpret_cast<const dirent64*>(buffer + offset);
+            offset += dirent->d_reclen;
+
+            const char* name = dirent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (!state.showHidden && name[0] == '.') {
+                continue;
+            }
+
+            bool isDir = dirent->d_type == DT_DIR;
+            bool descend = isDir;
+            if (dirent->d_type != DT_DIR && dirent->d_type != DT_REG) {
+                // Symlinks, and filesystems that don't fill in d_type, are the only entries that need a stat
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    continue;
+                }
+                const bool isLink = S_ISLNK(st.st_mode);
+                if (isLink && fstatat(fd, name, &st, 0) == -1) {
+                    continue;
+                }
+                if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                    continue;
+                }
+                isDir = S_ISDIR(st.st_mode);
+                descend = isDir && !isLink;
+            }
+
+            DirectoryWalker::Entry entry{ dir + '/' + QFile::decodeName(name), isDir };
+            if (descend) {
+                subdirs << entry.path;
+            }
+            if (state.accept(entry)) {
+                chunk.append(std::move(entry));
+            }
+        }
+
+        if (state.isCanceled()) {
+            break;
+        }
+    }
+
+    close(fd);
+    return complete;
+}
+
+void work(WalkState& state) {
+    ChunkBuffer chunk(state);
+
+    for (;;) {
+        QMutexLocker locker(&state.mutex);
+
+        if (state.pending.isEmpty() && state.active > 0) {
+            // Don't hold on to results while idle
+            if (!chunk.isEmpty()) {
+                locker.unlock();
+                chunk.flush();
+                continue;
+            }
+
+            while (state.pending.isEmpty() && state.active > 0) {
+                state.wake.wait(&state.mutex);
+            }
+        }
+
+        // Nothing queued and nobody left to queue more
+        if (state.pending.isEmpty()) {
+            break;
+        }
+
+        // Depth first keeps the queue short and the directories hot in the dentry cache
+        const QString dir = state.pending.takeLast();
+        ++state.active;
+        locker.unlock();
+
+        QStringList subdirs;
+        qint64 mtime = 0;
+        const bool complete = !state.isCanceled() && listDirectory(dir, state, chunk, subdirs, mtime);
+
+        if (complete && state.onDirectory && !state.isCanceled()) {
+            QMutexLocker chunkLocker(&state.chunkMutex);
+            state.onDirectory(dir, mtime, QStringList(subdirs));
+        }
+
+        locker.relock();
+        if (state.isCanceled()) {
+            state.pending.clear();
+        } else if (state.recursive) {
+            state.pending << subdirs;
+            state.discovered += static_cast<int>(subdirs.size());
+        }
+        ++state.listed;
+        --state.active;
+        state.wake.wakeAll();
+    }
+
+    chunk.flush();
+}
+
+} // namespace
+
+void DirectoryWalker::walk(const QString& root, bool recursive, bool showHidden, const Predicate& accept,
+    const std::function<bool()>& isCanceled, const ChunkHandler& onChunk, const DirectoryHandler& onDirectory) {
+    WalkState state{ recursive, showHidden, accept, isCanceled, onChunk, onDirectory };
+    state.pending << QDir::cleanPath(root);
+
+    // Helpers only join if a thread is free right away, the calling thread does the work otherwise
+    int helpers = 0;
+    QSemaphore finished;
+    if (recursive) {
+        for (int i = 1; i < pool().maxThreadCount(); ++i) {
+            if (!pool().tryStart([&state, &finished]() {
+                    work(state);
+                    finished.release();
+                })) {
+                break;
+            }
+            ++helpers;
+        }
+    }
+
+    work(state);
+    finished.acquire(helpers);
+}
+
+} // namespace caelestia::models
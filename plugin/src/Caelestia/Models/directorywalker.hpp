@@ -0,0 +1,34 @@
+#pragma once
+
+#include <functional>
+#include <qlist.h>
+#include <qstring.h>
+
+namespace caelestia::models {
+
+// Lists a directory tree straight from getdents64, using the entry types the kernel already returns instead of
+// stating every file. Subdirectories are spread over a shared pool and results are handed out in chunks as they are
+// found, so callers can start on them before the walk is done
+class DirectoryWalker {
+public:
+    struct Entry {
+        QString path;
+        bool isDir = false;
+    };
+
+    using Predicate = std::function<bool(const Entry&)>;
+    // progress is the share of directories found so far that have been listed, a rough estimate at best
+    using ChunkHandler = std::function<void(QList<Entry>&& chunk, qreal progress)>;
+    // Called once a directory has been listed in full, with its mtime in ns and the subdirectories it would descend
+    // into, whether or not the walk is recursive
+    using DirectoryHandler = std::function<void(const QString& dir, qint64 mtime, QStringList&& subdirs)>;
+
+    // Blocks until the tree has been listed or isCanceled returns true. accept runs on the walking threads and
+    // may do IO, onChunk and onDirectory are never called concurrently. Like QDirIterator, symlinks to directories are
+    // listed but not followed, and broken symlinks and special files are skipped
+    static void walk(const QString& root, bool recursive, bool showHidden, const Predicate& accept,
+        const std::function<bool()>& isCanceled, const ChunkHandler& onChunk,
+        const DirectoryHandler& onDirectory = nullptr);
+};
+
+} // namespace caelestia::models
@@ -1,11 +1,101 @@
 #include "filesystemmodel.hpp"
 
-#include <qdiriterator.h>
+#include "directorysnapshot.hpp"
+#include "directorywalker.hpp"
+#include "imagesniffer.hpp"
+#include <optional>
+#include <qdatetime.h>
+#include <qfile.h>
 #include <qfuturewatcher.h>
+#include <qregularexpression.h>
 #include <qtconcurrentrun.h>
+#include <sys/stat.h>
 
 namespace caelestia::models {
 
+namespace {
+
+constexpr int PROGRESS_RANGE = 1000;
+
+int compareValues(qint64 a, qint64 b) {
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+// Same as QFileInfo::completeSuffix
+QStringView suffixOf(const QString& name) {
+    const auto dot = name.indexOf('.');
+    return dot == -1 ? QStringView() : QStringView(name).sliced(dot + 1);
+}
+
+QStringList imageNameFilters(const QStringList& nameFilters) {
+    QStringList filters = nameFilters;
+    const auto formats = QImageReader::supportedImageFormats();
+    for (const auto& format : formats) {
+        filters << "*." + format;
+    }
+    return filters;
+}
+
+// Compiled once per scan rather than per file, as QDir::match would
+QList<QRegularExpression> compileNameFilters(const QStringList& nameFilters) {
+    QList<QRegularExpression> patterns;
+    patterns.reserve(nameFilters.size());
+    for (const auto& nameFilter : nameFilters) {
+        patterns << QRegularExpression::fromWildcard(nameFilter, Qt::CaseInsensitive);
+    }
+    return patterns;
+}
+
+// Patterns must come from compileNameFilters, with the image formats included for the Images filter
+bool acceptsEntry(const DirectoryWalker::Entry& entry, FileSystemModel::Filter filter,
+    const QList<QRegularExpression>& patterns) {
+    switch (filter) {
+    case FileSystemModel::Images:
+    case FileSystemModel::Files:
+        if (entry.isDir) {
+            return false;
+        }
+        break;
+    case FileSystemModel::Dirs:
+        if (!entry.isDir) {
+            return false;
+        }
+        break;
+    case FileSystemModel::NoFilter:
+        break;
+    }
+
+    if (!patterns.isEmpty()) {
+        const QString name = entry.path.sliced(entry.path.lastIndexOf('/') + 1);
+        if (std::none_of(patterns.cbegin(), patterns.cend(), [&name](const QRegularExpression& pattern) {
+                return pattern.match(name).hasMatch();
+            })) {
+            return false;
+        }
+    }
+
+    return filter != FileSystemModel::Images || ImageSniffer::instance().isImage(entry.path);
+}
+
+// Per path equivalent of the directory scan, for paths reported by the watcher
+std::optional<DirectoryWalker::Entry> acceptedEntry(
+    const QString& path, FileSystemModel::Filter filter, const QStringList& nameFilters, bool showHidden) {
+    const QFileInfo info(path);
+    if (!info.exists() || (!showHidden && info.isHidden()) || (!info.isFile() && !info.isDir())) {
+        return std::nullopt;
+    }
+
+    const auto patterns =
+        compileNameFilters(filter == FileSystemModel::Images ? imageNameFilters(nameFilters) : nameFilters);
+    DirectoryWalker::Entry entry{ path, info.isDir() };
+    if (!acceptsEntry(entry, filter, patterns)) {
+        return std::nullopt;
+    }
+    return entry;
+}
+
+} // namespace
+
 FileSystemEntry::FileSystemEntry(const QString& path, const QString& relativePath, QObject* parent)
     : QObject(parent)
     , m_fileInfo(path)
@@ -48,8 +138,7 @@ bool FileSystemEntry::isDir() const {
 
 bool FileSystemEntry::isImage() const {
     if (!m_isImageInitialised) {
-        QImageReader reader(m_path);
-        m_isImage = reader.canRead();
+        m_isImage = ImageSniffer::instance().isImage(m_path);
         m_isImageInitialised = true;
     }
     return m_isImage;
@@ -74,30 +163,93 @@ void FileSystemEntry::updateRelativePath(const QDir& dir) {
 
 FileSystemModel::FileSystemModel(QObject* parent)
     : QAbstractListModel(parent)
+    , m_applyingDelta(false)
+    , m_generation(0)
+    , m_updatingStats(false)
     , m_recursive(false)
     , m_watchChanges(true)
     , m_showHidden(false)
-    , m_filter(NoFilter) {
-    connect(&m_watcher, &QFileSystemWatcher::directoryChanged, this, &FileSystemModel::watchDirIfRecursive);
-    connect(&m_watcher, &QFileSystemWatcher::directoryChanged, this, &FileSystemModel::updateEntriesForDir);
+    , m_sortReverse(false)
+    , m_sortMode(Name)
+    , m_filter(NoFilter)
+    , m_snapshot(false)
+    , m_loading(false)
+    , m_progress(0.0) {
+    // Rows are inserted as a scan streams them in, entriesChanged only follows once it has finished
+    connect(this, &QAbstractItemModel::rowsInserted, this, &FileSystemModel::countChanged);
+    connect(this, &QAbstractItemModel::rowsRemoved, this, &FileSystemModel::countChanged);
+    connect(this, &QAbstractItemModel::modelReset, this, &FileSystemModel::countChanged);
+
+    connect(&m_watcher, &InotifyWatcher::changed, this, &FileSystemModel::onWatcherChanged);
+    connect(&m_watcher, &InotifyWatcher::overflowed, this, [this]() {
+        // Events were lost, diff the whole tree against what we have
+        updateEntriesForDir(m_path, false);
+    });
+    connect(&m_watcher, &InotifyWatcher::watchCountChanged, this, &FileSystemModel::watchCountChanged);
+    connect(&m_watcher, &InotifyWatcher::limitReachedChanged, this, &FileSystemModel::watchLimitReachedChanged);
 }
 
 int FileSystemModel::rowCount(const QModelIndex& parent) const {
     if (parent != QModelIndex()) {
         return 0;
     }
-    return static_cast<int>(m_entries.size());
+    return static_cast<int>(m_order.size());
 }
 
 QVariant FileSystemModel::data(const QModelIndex& index, int role) const {
-    if (role != Qt::UserRole || !index.isValid() || index.row() >= m_entries.size()) {
+    if (!index.isValid() || index.row() >= m_order.size()) {
+        return QVariant();
+    }
+
+    const int slot = m_order.at(index.row());
+    const QString& name = m_names.at(slot);
+    const auto dot = name.indexOf('.');
+
+    switch (role) {
+    case EntryRole:
+        return QVariant::fromValue(slotEntry(slot));
+    case PathRole:
+        return slotPath(slot);
+    case RelativePathRole:
+        return slotRelativePath(slot);
+    case NameRole:
+        return name;
+    case BaseNameRole:
+        return dot == -1 ? name : name.left(dot);
+    case ParentDirRole:
+        return m_dirs.at(m_parents.at(slot));
+    case SuffixRole:
+        return dot == -1 ? QString() : name.sliced(dot + 1);
+    case SizeRole:
+        return slotSize(slot);
+    case ModifiedRole:
+        return QDateTime::fromMSecsSinceEpoch(slotModified(slot));
+    case IsDirRole:
+        return (m_flags.at(slot) & DirFlag) != 0;
+    case IsImageRole:
+        return slotIsImage(slot);
+    case MimeTypeRole:
+        return slotMimeType(slot);
+    default:
         return QVariant();
     }
-    return QVariant::fromValue(m_entries.at(index.row()));
 }
 
 QHash<int, QByteArray> FileSystemModel::roleNames() const {
-    return { { Qt::UserRole, "modelData" } };
+    return {
+        { EntryRole, "modelData" },
+        { PathRole, "path" },
+        { RelativePathRole, "relativePath" },
+        { NameRole, "name" },
+        { BaseNameRole, "baseName" },
+        { ParentDirRole, "parentDir" },
+        { SuffixRole, "suffix" },
+        { SizeRole, "size" },
+        { ModifiedRole, "modified" },
+        { IsDirRole, "isDir" },
+        { IsImageRole, "isImage" },
+        { MimeTypeRole, "mimeType" },
+    };
 }
 
 QString FileSystemModel::path() const {
@@ -114,8 +266,13 @@ void FileSystemModel::setPath(const QString& path) {
 
     m_dir.setPath(m_path);
 
-    for (const auto& entry : std::as_const(m_entries)) {
-        entry->updateRelativePath(m_dir);
+    // Rows of another directory would otherwise linger until the new one has been walked, as the scan only reports
+    // removals once it has seen everything. Only rescans of the same path keep their rows
+    if (!m_order.isEmpty()) {
+        beginResetModel();
+        clearSlots();
+        endResetModel();
+        emit entriesChanged();
     }
 
     update();
@@ -178,7 +335,23 @@ void FileSystemModel::setSortReverse(bool sortReverse) {
     m_sortReverse = sortReverse;
     emit sortReverseChanged();
 
-    update();
+    sortRows();
+}
+
+FileSystemModel::SortMode FileSystemModel::sortMode() const {
+    return m_sortMode;
+}
+
+void FileSystemModel::setSortMode(SortMode sortMode) {
+    if (m_sortMode == sortMode) {
+        return;
+    }
+
+    m_sortMode = sortMode;
+    emit sortModeChanged();
+
+    sortRows();
+    updateStats();
 }
 
 FileSystemModel::Filter FileSystemModel::filter() const {
@@ -211,37 +384,62 @@ void FileSystemModel::setNameFilters(const QStringList& nameFilters) {
     update();
 }
 
+bool FileSystemModel::snapshot() const {
+    return m_snapshot;
+}
+
+void FileSystemModel::setSnapshot(bool snapshot) {
+    if (m_snapshot == snapshot) {
+        return;
+    }
+
+    m_snapshot = snapshot;
+    emit snapshotChanged();
+
+    // A scan that is already running wouldn't record anything to save
+    if (m_snapshot) {
+        updateEntries();
+    }
+}
+
 QList<FileSystemEntry*> FileSystemModel::entries() const {
-    return m_entries;
+    QList<FileSystemEntry*> entries;
+    entries.reserve(m_order.size());
+    for (const int slot : m_order) {
+        entries << slotEntry(slot);
+    }
+    return entries;
 }
 
-void FileSystemModel::watchDirIfRecursive(const QString& path) {
-    if (m_recursive && m_watchChanges) {
-        const auto currentDir = m_dir;
-        const bool showHidden = m_showHidden;
-        const auto future = QtConcurrent::run([showHidden, path]() {
-            QDir::Filters filters = QDir::Dirs | QDir::NoDotAndDotDot;
-            if (showHidden) {
-                filters |= QDir::Hidden;
-            }
+QStringList FileSystemModel::paths() const {
+    QStringList paths;
+    paths.reserve(m_order.size());
+    for (const int slot : m_order) {
+        paths << slotPath(slot);
+    }
+    return paths;
+}
 
-            QDirIterator iter(path, filters, QDirIterator::Subdirectories);
-            QStringList dirs;
-            while (iter.hasNext()) {
-                dirs << iter.next();
-            }
-            return dirs;
-        });
-        const auto watcher = new QFutureWatcher<QStringList>(this);
-        connect(watcher, &QFutureWatcher<QStringList>::finished, this, [currentDir, showHidden, watcher, this]() {
-            const auto paths = watcher->result();
-            if (currentDir == m_dir && showHidden == m_showHidden && !paths.isEmpty()) {
-                // Ignore if dir or showHidden has changed
-                m_watcher.addPaths(paths);
-            }
-            watcher->deleteLater();
-        });
-        watcher->setFuture(future);
+bool FileSystemModel::loading() const {
+    return m_loading;
+}
+
+qreal FileSystemModel::progress() const {
+    return m_progress;
+}
+
+int FileSystemModel::watchCount() const {
+    return m_watcher.watchCount();
+}
+
+bool FileSystemModel::watchLimitReached() const {
+    return m_watcher.limitReached();
+}
+
+void FileSystemModel::setLoading(bool loading) {
+    if (m_loading != loading) {
+        m_loading = loading;
+        emit loadingChanged();
     }
 }
 
@@ -251,24 +449,31 @@ void FileSystemModel::update() {
 }
 
 void FileSystemModel::updateWatcher() {
-    if (!m_watcher.directories().isEmpty()) {
-        m_watcher.removePaths(m_watcher.directories());
-    }
-
     if (!m_watchChanges || m_path.isEmpty()) {
+        m_watcher.clear();
         return;
     }
 
-    m_watcher.addPath(m_path);
-    watchDirIfRecursive(m_path);
+    m_watcher.watch(m_path, m_recursive, m_showHidden);
 }
 
 void FileSystemModel::updateEntries() {
+    for (auto& future : m_futures) {
+        future.cancel();
+    }
+    m_futures.clear();
+
+    // Pending deltas were filtered with the old settings, the rescan supersedes them
+    m_deltas.clear();
+    m_applyingDelta = false;
+    ++m_generation;
+
     if (m_path.isEmpty()) {
-        if (!m_entries.isEmpty()) {
+        setLoading(false);
+
+        if (!m_order.isEmpty()) {
             beginResetModel();
-            qDeleteAll(m_entries);
-            m_entries.clear();
+            clearSlots();
             endResetModel();
             emit entriesChanged();
         }
@@ -276,88 +481,149 @@ void FileSystemModel::updateEntries() {
         return;
     }
 
-    for (auto& future : m_futures) {
-        future.cancel();
-    }
-    m_futures.clear();
-
-    updateEntriesForDir(m_path);
+    // Only restored into an empty model, e.g. on startup, so the rows can be shown before anything is walked. The
+    // scan then lists only the directories that have changed since
+    updateEntriesForDir(m_path, m_snapshot && m_order.isEmpty());
 }
 
-void FileSystemModel::updateEntriesForDir(const QString& dir) {
+void FileSystemModel::updateEntriesForDir(const QString& dir, bool restore) {
     const auto recursive = m_recursive;
     const auto showHidden = m_showHidden;
     const auto filter = m_filter;
     const auto nameFilters = m_nameFilters;
+    const auto key = m_snapshot ? snapshotKey() : QString();
+    const auto withStats = sortedByStat();
 
-    QSet<QString> oldPaths;
-    for (const auto& entry : std::as_const(m_entries)) {
-        oldPaths << entry->path();
-    }
+    // Everything the model has, the scan reports whatever it no longer finds as removed
+    const QSet<QString> oldPaths(m_index.keyBegin(), m_index.keyEnd());
 
-    const auto future = QtConcurrent::run([=](QPromise<QPair<QSet<QString>, QSet<QString>>>& promise) {
-        const auto flags = recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags;
+    // Results are published in batches as the walk goes, additions first and removals once everything has been seen
+    const auto future = QtConcurrent::run([=](QPromise<Changes>& promise) {
+        const auto patterns = compileNameFilters(filter == Images ? imageNameFilters(nameFilters) : nameFilters);
 
-        std::optional<QDirIterator> iter;
+        promise.setProgressRange(0, PROGRESS_RANGE);
 
-        if (filter == Images) {
-            QStringList extraNameFilters = nameFilters;
-            const auto formats = QImageReader::supportedImageFormats();
-            for (const auto& format : formats) {
-                extraNameFilters << "*." + format;
-            }
+        // Sort keys are the expensive part of inserting, so they are built here rather than on the GUI thread
+        const QCollator collator;
+        const QDir root(dir);
 
-            QDir::Filters filters = QDir::Files;
-            if (showHidden) {
-                filters |= QDir::Hidden;
+        // The restored snapshot is published as the first batch, its entries are then checked like existing rows
+        QSet<QString> knownPaths = oldPaths;
+        std::optional<DirectorySnapshot> baseline;
+        if (restore) {
+            baseline = DirectorySnapshot::load(key);
+        }
+        if (baseline) {
+            Changes restored;
+            restored.added = baseline->entries();
+            restored.sortKeys.reserve(restored.added.size());
+            for (const auto& entry : std::as_const(restored.added)) {
+                knownPaths << entry.path;
+                restored.sortKeys << collator.sortKey(root.relativeFilePath(entry.path));
+                if (withStats) {
+                    restored.stats << statPath(entry.path);
+                }
             }
 
-            iter.emplace(dir, extraNameFilters, filters, flags);
-        } else {
-            QDir::Filters filters;
-
-            if (filter == Files) {
-                filters = QDir::Files;
-            } else if (filter == Dirs) {
-                filters = QDir::Dirs | QDir::NoDotAndDotDot;
-            } else {
-                filters = QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot;
+            if (!restored.added.isEmpty()) {
+                promise.addResult(std::move(restored));
             }
+        }
 
-            if (showHidden) {
-                filters |= QDir::Hidden;
+        QSet<QString> seenPaths;
+        const auto report = [&](QList<DirectoryWalker::Entry>&& chunk, qreal progress) {
+            Changes changes;
+            for (auto& entry : chunk) {
+                if (knownPaths.contains(entry.path)) {
+                    seenPaths << entry.path;
+                } else {
+                    changes.sortKeys << collator.sortKey(root.relativeFilePath(entry.path));
+                    if (withStats) {
+                        changes.stats << statPath(entry.path);
+                    }
+                    changes.added << std::move(entry);
+                }
             }
 
-            if (nameFilters.isEmpty()) {
-                iter.emplace(dir, filters, flags);
-            } else {
-                iter.emplace(dir, nameFilters, filters, flags);
+            if (!changes.added.isEmpty()) {
+                promise.addResult(std::move(changes));
             }
-        }
-
-        QSet<QString> newPaths;
-        while (iter->hasNext()) {
-            if (promise.isCanceled()) {
-                return;
+            promise.setProgressValue(static_cast<int>(progress * PROGRESS_RANGE));
+        };
+
+        // The walk is recorded as it goes when it is to be saved, the walker serialises both handlers
+        DirectorySnapshot next;
+        const auto record = [&](QList<DirectoryWalker::Entry>&& chunk, qreal progress) {
+            for (const auto& entry : std::as_const(chunk)) {
+                next.dirs[entry.path.left(entry.path.lastIndexOf('/'))].entries << entry;
             }
+            report(std::move(chunk), progress);
+        };
+        const auto recordDir = [&next](const QString& listed, qint64 mtime, QStringList&& subdirs) {
+            auto& listing = next.dirs[listed];
+            listing.mtime = mtime;
+            listing.subdirs = std::move(subdirs);
+        };
+
+        const auto accept = [filter, &patterns](const DirectoryWalker::Entry& entry) {
+            return acceptsEntry(entry, filter, patterns);
+        };
+        const auto isCanceled = [&promise]() {
+            return promise.isCanceled();
+        };
+
+        if (baseline) {
+            // Directories with the mtime the snapshot recorded still have the same entries, so only the others are
+            // listed again. New subdirectories turn up in their parent's listing and are then walked like the rest
+            QStringList pending{ QDir::cleanPath(dir) };
+            int visited = 0;
+            while (!pending.isEmpty() && !promise.isCanceled()) {
+                const QString current = pending.takeLast();
+                const qreal progress = static_cast<qreal>(visited) / static_cast<qreal>(visited + pending.size() + 1);
+                ++visited;
+
+                // Gone, anything that was below it is reported as removed
+                const qint64 mtime = DirectorySnapshot::mtime(current);
+                if (mtime == -1) {
+                    continue;
+                }
 
-            QString path = iter->next();
-
-            if (filter == Images) {
-                QImageReader reader(path);
-                if (!reader.canRead()) {
+                const auto it = baseline->dirs.constFind(current);
+                if (it != baseline->dirs.cend() && it->mtime == mtime) {
+                    next.dirs.insert(current, *it);
+                    report(QList(it->entries), progress);
+                    if (recursive) {
+                        pending << it->subdirs;
+                    }
                     continue;
                 }
-            }
 
-            newPaths.insert(path);
+                DirectoryWalker::walk(current, false, showHidden, accept, isCanceled, record,
+                    [&](const QString& listed, qint64 listedMtime, QStringList&& subdirs) {
+                        if (recursive) {
+                            pending << subdirs;
+                        }
+                        recordDir(listed, listedMtime, std::move(subdirs));
+                    });
+            }
+        } else if (key.isEmpty()) {
+            DirectoryWalker::walk(dir, recursive, showHidden, accept, isCanceled, report);
+        } else {
+            DirectoryWalker::walk(dir, recursive, showHidden, accept, isCanceled, record, recordDir);
         }
 
-        if (promise.isCanceled() || newPaths == oldPaths) {
+        if (promise.isCanceled()) {
             return;
         }
 
-        promise.addResult(qMakePair(oldPaths - newPaths, newPaths - oldPaths));
+        const auto removedPaths = knownPaths - seenPaths;
+        if (!removedPaths.isEmpty()) {
+            promise.addResult(Changes{ removedPaths, {}, {} });
+        }
+
+        if (!key.isEmpty()) {
+            next.save(key);
+        }
     });
 
     if (m_futures.contains(dir)) {
@@ -365,18 +631,48 @@ void FileSystemModel::updateEntriesForDir(const QString& dir) {
     }
     m_futures.insert(dir, future);
 
-    const auto watcher = new QFutureWatcher<QPair<QSet<QString>, QSet<QString>>>(this);
+    m_progress = 0.0;
+    emit progressChanged();
+    setLoading(true);
 
-    connect(watcher, &QFutureWatcher<QPair<QSet<QString>, QSet<QString>>>::finished, this, [dir, watcher, this]() {
-        m_futures.remove(dir);
+    const auto watcher = new QFutureWatcher<Changes>(this);
 
-        if (!watcher->future().isResultReadyAt(0)) {
-            watcher->deleteLater();
-            return;
+    connect(watcher, &QFutureWatcher<Changes>::resultsReadyAt, this,
+        [watcher, this](int begin, int end) {
+            // Batches queued before a cancel can still arrive, they belong to a scan that has been superseded
+            if (watcher->isCanceled()) {
+                return;
+            }
+
+            for (int i = begin; i < end; ++i) {
+                applyChanges(watcher->resultAt(i));
+            }
+        });
+
+    connect(watcher, &QFutureWatcher<Changes>::progressValueChanged, this,
+        [watcher, this](int value) {
+            if (watcher->isCanceled()) {
+                return;
+            }
+
+            m_progress = static_cast<qreal>(value) / PROGRESS_RANGE;
+            emit progressChanged();
+        });
+
+    connect(watcher, &QFutureWatcher<Changes>::finished, this, [dir, watcher, this]() {
+        // A canceled scan has already been replaced or dropped from m_futures
+        if (!watcher->isCanceled()) {
+            m_futures.remove(dir);
+
+            // Batches are applied as they arrive, but the entries are only announced once they are complete
+            emit entriesChanged();
         }
 
-        const auto result = watcher->result();
-        applyChanges(result.first, result.second);
+        if (m_futures.isEmpty()) {
+            m_progress = 1.0;
+            emit progressChanged();
+            setLoading(false);
+        }
 
         watcher->deleteLater();
     });
@@ -384,95 +680,487 @@ void FileSystemModel::updateEntriesForDir(const QString& dir) {
     watcher->setFuture(future);
 }
 
-void FileSystemModel::applyChanges(const QSet<QString>& removedPaths, const QSet<QString>& addedPaths) {
-    QList<int> removedIndices;
-    for (int i = 0; i < m_entries.size(); ++i) {
-        if (removedPaths.contains(m_entries[i]->path())) {
-            removedIndices << i;
+QString FileSystemModel::snapshotKey() const {
+    // Everything that decides which entries a scan accepts
+    return QStringLiteral("%1:%2:%3:%4:%5")
+        .arg(m_recursive)
+        .arg(m_showHidden)
+        .arg(static_cast<int>(m_filter))
+        .arg(m_nameFilters.join('/'))
+        .arg(QDir::cleanPath(m_path));
+}
+
+void FileSystemModel::onWatcherChanged(const QStringList& created, const QStringList& removed,
+    const QStringList& modified, const QStringList& removedDirs) {
+    // Modified paths are rechecked too, e.g. an image only becomes readable once it has been written
+    m_deltas << Delta{ removed, removedDirs, created + modified };
+
+    if (!m_applyingDelta) {
+        applyNextDelta();
+    }
+}
+
+void FileSystemModel::applyNextDelta() {
+    if (m_deltas.isEmpty()) {
+        m_applyingDelta = false;
+        return;
+    }
+
+    m_applyingDelta = true;
+    const Delta delta = m_deltas.takeFirst();
+
+    // The watcher reports a removed directory on its own, so anything below it has to be found here. Files are
+    // looked up directly, only what the watcher saw as a directory needs a pass over the entries
+    Changes removals;
+    for (const auto& path : delta.removed) {
+        if (m_index.contains(path)) {
+            removals.removed << path;
+        }
+    }
+    QStringList removedDirs;
+    for (const auto& path : delta.removedDirs) {
+        if (m_recursive || path == m_path) {
+            removedDirs << path + "/";
+        }
+    }
+    if (!removedDirs.isEmpty()) {
+        for (auto it = m_index.cbegin(); it != m_index.cend(); ++it) {
+            if (std::any_of(removedDirs.cbegin(), removedDirs.cend(), [&it](const QString& prefix) {
+                    return it.key().startsWith(prefix);
+                })) {
+                removals.removed << it.key();
+            }
+        }
+    }
+
+    if (!removals.removed.isEmpty()) {
+        applyChanges(removals);
+        emit entriesChanged();
+    }
+
+    if (delta.changed.isEmpty()) {
+        applyNextDelta();
+        return;
+    }
+
+    // Filtering may need to read the files, so it happens off the GUI thread
+    const auto filter = m_filter;
+    const auto nameFilters = m_nameFilters;
+    const auto showHidden = m_showHidden;
+    const auto withStats = sortedByStat();
+    const auto generation = m_generation;
+
+    QtConcurrent::run([=, changed = delta.changed]() {
+        Changes accepted;
+        for (const auto& path : changed) {
+            if (auto entry = acceptedEntry(path, filter, nameFilters, showHidden)) {
+                if (withStats) {
+                    accepted.stats << statPath(path);
+                }
+                accepted.added << std::move(*entry);
+            }
+        }
+        return accepted;
+    }).then(this, [generation, withStats, changed = delta.changed, this](const Changes& accepted) {
+        if (generation != m_generation) {
+            return;
+        }
+
+        // Rows that are still there but were written to have a new size and modification time. When those decide
+        // the order the row is moved by removing and reinserting it
+        const bool moveChanged = withStats && sortedByStat();
+
+        Changes changes;
+        QSet<QString> acceptedPaths;
+        for (qsizetype i = 0; i < accepted.added.size(); ++i) {
+            const auto& entry = accepted.added.at(i);
+            acceptedPaths << entry.path;
+
+            const int slot = m_index.value(entry.path, -1);
+            if (slot == -1) {
+                changes.added << entry;
+                if (withStats) {
+                    changes.stats << accepted.stats.at(i);
+                }
+            } else if (moveChanged) {
+                const auto& stat = accepted.stats.at(i);
+                if (!(m_flags.at(slot) & StatFlag) || m_sizes.at(slot) != stat.size ||
+                    m_modified.at(slot) != stat.modified) {
+                    changes.removed << entry.path;
+                    changes.added << entry;
+                    changes.stats << stat;
+                }
+            } else if ((m_flags.at(slot) & StatFlag) || !m_mimeTypes.at(slot).isEmpty()) {
+                m_flags[slot] = static_cast<quint8>(m_flags.at(slot) & ~StatFlag);
+                m_mimeTypes[slot].clear();
+                const QModelIndex idx = index(rowOf(slot));
+                emit dataChanged(idx, idx, { SizeRole, ModifiedRole, MimeTypeRole });
+            }
+        }
+        for (const auto& path : changed) {
+            if (!acceptedPaths.contains(path) && m_index.contains(path)) {
+                changes.removed << path;
+            }
+        }
+
+        if (!changes.removed.isEmpty() || !changes.added.isEmpty()) {
+            applyChanges(changes);
+            emit entriesChanged();
+        }
+
+        applyNextDelta();
+    });
+}
+
+void FileSystemModel::applyChanges(const Changes& changes) {
+    QList<int> removedRows;
+    for (const auto& path : changes.removed) {
+        if (const int slot = m_index.value(path, -1); slot != -1) {
+            removedRows << rowOf(slot);
         }
     }
-    std::sort(removedIndices.begin(), removedIndices.end(), std::greater<int>());
+    std::sort(removedRows.begin(), removedRows.end(), std::greater<int>());
+
+    // Batch remove old rows, each run is erased in one go so large removals stay linear
+    const auto removeRun = [this](int first, int last) {
+        beginRemoveRows(QModelIndex(), first, last);
+        for (int i = first; i <= last; ++i) {
+            releaseSlot(m_order.at(i));
+        }
+        m_order.remove(first, last - first + 1);
+        endRemoveRows();
+    };
 
-    // Batch remove old entries
     int start = -1;
     int end = -1;
-    for (int idx : std::as_const(removedIndices)) {
+    for (int row : std::as_const(removedRows)) {
         if (start == -1) {
-            start = idx;
-            end = idx;
-        } else if (idx == end - 1) {
-            end = idx;
+            start = row;
+            end = row;
+        } else if (row == end - 1) {
+            end = row;
         } else {
-            beginRemoveRows(QModelIndex(), end, start);
-            for (int i = start; i >= end; --i) {
-                m_entries.takeAt(i)->deleteLater();
-            }
-            endRemoveRows();
+            removeRun(end, start);
 
-            start = idx;
-            end = idx;
+            start = row;
+            end = row;
         }
     }
     if (start != -1) {
-        beginRemoveRows(QModelIndex(), end, start);
-        for (int i = start; i >= end; --i) {
-            m_entries.takeAt(i)->deleteLater();
-        }
-        endRemoveRows();
+        removeRun(end, start);
     }
 
-    // Create new entries
-    QList<FileSystemEntry*> newEntries;
-    for (const auto& path : addedPaths) {
-        newEntries << new FileSystemEntry(path, m_dir.relativeFilePath(path), this);
+    // Fill slots for new rows
+    QList<int> newSlots;
+    for (qsizetype i = 0; i < changes.added.size(); ++i) {
+        const auto& entry = changes.added.at(i);
+
+        // Overlapping scans and deltas can both report the same addition
+        if (m_index.contains(entry.path)) {
+            continue;
+        }
+
+        newSlots << allocateSlot(entry,
+            i < changes.sortKeys.size() ? changes.sortKeys.at(i)
+                                        : m_collator.sortKey(m_dir.relativeFilePath(entry.path)),
+            i < changes.stats.size() ? std::optional(changes.stats.at(i)) : std::nullopt);
     }
-    std::sort(newEntries.begin(), newEntries.end(), [this](const FileSystemEntry* a, const FileSystemEntry* b) {
-        return compareEntries(a, b);
+    std::sort(newSlots.begin(), newSlots.end(), [this](int a, int b) {
+        return compareSlots(a, b);
     });
 
-    // Batch insert new entries
-    int insertStart = -1;
-    QList<FileSystemEntry*> batchItems;
-    for (const auto& entry : std::as_const(newEntries)) {
-        const auto it = std::lower_bound(
-            m_entries.begin(), m_entries.end(), entry, [this](const FileSystemEntry* a, const FileSystemEntry* b) {
-                return compareEntries(a, b);
-            });
-        const auto row = static_cast<int>(it - m_entries.begin());
-
-        if (insertStart == -1) {
-            insertStart = row;
-            batchItems << entry;
-        } else if (row == insertStart + batchItems.size()) {
-            batchItems << entry;
+    // Both lists are sorted, so a single merge pass finds where each run of new rows goes among the existing ones
+    struct Run {
+        qsizetype row;
+        qsizetype first;
+        qsizetype count;
+    };
+    QList<Run> runs;
+    qsizetype row = 0;
+    for (qsizetype i = 0; i < newSlots.size(); ++i) {
+        while (row < m_order.size() && compareSlots(m_order.at(row), newSlots.at(i))) {
+            ++row;
+        }
+
+        if (!runs.isEmpty() && runs.last().row == row) {
+            ++runs.last().count;
         } else {
-            beginInsertRows(QModelIndex(), insertStart, insertStart + static_cast<int>(batchItems.size()) - 1);
-            for (int i = 0; i < batchItems.size(); ++i) {
-                m_entries.insert(insertStart + i, batchItems[i]);
-            }
-            endInsertRows();
+            runs << Run{ row, i, 1 };
+        }
+    }
+
+    // Batch insert each run, shifted by the rows inserted before it
+    qsizetype offset = 0;
+    for (const auto& run : std::as_const(runs)) {
+        const qsizetype first = run.row + offset;
+        beginInsertRows(QModelIndex(), static_cast<int>(first), static_cast<int>(first + run.count - 1));
+        m_order.insert(first, run.count, -1);
+        std::copy_n(newSlots.cbegin() + run.first, run.count, m_order.begin() + first);
+        endInsertRows();
+
+        offset += run.count;
+    }
+
+    // Rows that came without a stat while sorting by one are sorted as empty until updateStats has it
+    if (sortedByStat() && std::any_of(newSlots.cbegin(), newSlots.cend(), [this](int slot) {
+            return !(m_flags.at(slot) & StatFlag);
+        })) {
+        updateStats();
+    }
+}
+
+void FileSystemModel::clearSlots() {
+    for (const auto& entry : std::as_const(m_objects)) {
+        entry->deleteLater();
+    }
+    m_objects.clear();
+
+    m_names.clear();
+    m_parents.clear();
+    m_flags.clear();
+    m_sizes.clear();
+    m_modified.clear();
+    m_mimeTypes.clear();
+    m_sortKeys.clear();
+    m_freeSlots.clear();
+    m_order.clear();
+    m_index.clear();
+    m_dirs.clear();
+    m_dirIds.clear();
+}
+
+bool FileSystemModel::sortedByStat() const {
+    return m_sortMode == Modified || m_sortMode == Size;
+}
+
+void FileSystemModel::updateStats() {
+    if (m_updatingStats || !sortedByStat()) {
+        return;
+    }
 
-            insertStart = row;
-            batchItems.clear();
-            batchItems << entry;
+    QStringList paths;
+    for (const int slot : std::as_const(m_order)) {
+        if (!(m_flags.at(slot) & StatFlag)) {
+            paths << slotPath(slot);
         }
     }
-    if (!batchItems.isEmpty()) {
-        beginInsertRows(QModelIndex(), insertStart, insertStart + static_cast<int>(batchItems.size()) - 1);
-        for (int i = 0; i < batchItems.size(); ++i) {
-            m_entries.insert(insertStart + i, batchItems[i]);
+    if (paths.isEmpty()) {
+        return;
+    }
+
+    // Stating every row on the GUI thread, as the comparators would, blocks it for large directories
+    m_updatingStats = true;
+    QtConcurrent::run([paths]() {
+        QList<FileStat> stats;
+        stats.reserve(paths.size());
+        for (const auto& path : paths) {
+            stats << statPath(path);
         }
-        endInsertRows();
+        return stats;
+    }).then(this, [paths, this](const QList<FileStat>& stats) {
+        m_updatingStats = false;
+
+        // Rows are matched by path, they may have been removed or replaced in the meantime
+        for (qsizetype i = 0; i < paths.size(); ++i) {
+            const int slot = m_index.value(paths.at(i), -1);
+            if (slot != -1 && !(m_flags.at(slot) & StatFlag)) {
+                m_sizes[slot] = stats.at(i).size;
+                m_modified[slot] = stats.at(i).modified;
+                m_flags[slot] = static_cast<quint8>(m_flags.at(slot) | StatFlag);
+            }
+        }
+
+        if (sortedByStat()) {
+            sortRows();
+        }
+
+        // Picks up rows added while this ran
+        updateStats();
+    });
+}
+
+FileSystemModel::FileStat FileSystemModel::statPath(const QString& path) {
+    struct stat st;
+    if (stat(QFile::encodeName(path).constData(), &st) == -1) {
+        return {};
+    }
+    return { static_cast<qint64>(st.st_size),
+        static_cast<qint64>(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000 };
+}
+
+int FileSystemModel::allocateSlot(
+    const DirectoryWalker::Entry& entry, const QCollatorSortKey& sortKey, const std::optional<FileStat>& fileStat) {
+    const auto slash = entry.path.lastIndexOf('/');
+    const QString dir = entry.path.left(slash);
+
+    int parent = m_dirIds.value(dir, -1);
+    if (parent == -1) {
+        parent = static_cast<int>(m_dirs.size());
+        m_dirs << dir;
+        m_dirIds.insert(dir, parent);
+    }
+
+    auto flags = static_cast<quint8>(entry.isDir ? DirFlag : 0);
+    if (m_filter == Images) {
+        // Everything the images filter lets through has been sniffed already
+        flags = static_cast<quint8>(flags | ImageKnownFlag | ImageFlag);
+    }
+    if (fileStat) {
+        flags = static_cast<quint8>(flags | StatFlag);
+    }
+    const qint64 size = fileStat ? fileStat->size : 0;
+    const qint64 modified = fileStat ? fileStat->modified : 0;
+
+    int slot;
+    if (m_freeSlots.isEmpty()) {
+        slot = static_cast<int>(m_names.size());
+        m_names << entry.path.sliced(slash + 1);
+        m_parents << parent;
+        m_flags << flags;
+        m_sizes << size;
+        m_modified << modified;
+        m_mimeTypes << QString();
+        m_sortKeys << sortKey;
+    } else {
+        slot = m_freeSlots.takeLast();
+        m_names[slot] = entry.path.sliced(slash + 1);
+        m_parents[slot] = parent;
+        m_flags[slot] = flags;
+        m_sizes[slot] = size;
+        m_modified[slot] = modified;
+        m_mimeTypes[slot].clear();
+        m_sortKeys[slot] = sortKey;
+    }
+
+    m_index.insert(entry.path, slot);
+    return slot;
+}
+
+void FileSystemModel::releaseSlot(int slot) {
+    m_index.remove(slotPath(slot));
+    if (const auto entry = m_objects.take(slot)) {
+        entry->deleteLater();
+    }
+
+    m_names[slot].clear();
+    m_mimeTypes[slot].clear();
+    m_freeSlots << slot;
+}
+
+QString FileSystemModel::slotPath(int slot) const {
+    return m_dirs.at(m_parents.at(slot)) + '/' + m_names.at(slot);
+}
+
+QString FileSystemModel::slotRelativePath(int slot) const {
+    return m_dir.relativeFilePath(slotPath(slot));
+}
+
+bool FileSystemModel::slotIsImage(int slot) const {
+    quint8& flags = m_flags[slot];
+    if (!(flags & ImageKnownFlag)) {
+        const bool isImage = !(flags & DirFlag) && ImageSniffer::instance().isImage(slotPath(slot));
+        flags = static_cast<quint8>(flags | ImageKnownFlag | (isImage ? ImageFlag : 0));
+    }
+    return flags & ImageFlag;
+}
+
+qint64 FileSystemModel::slotSize(int slot) const {
+    statSlot(slot);
+    return m_sizes.at(slot);
+}
+
+qint64 FileSystemModel::slotModified(int slot) const {
+    statSlot(slot);
+    return m_modified.at(slot);
+}
+
+QString FileSystemModel::slotMimeType(int slot) const {
+    // Matching by content reads the file, so it is only done once per row
+    QString& mimeType = m_mimeTypes[slot];
+    if (mimeType.isEmpty()) {
+        mimeType = QMimeDatabase().mimeTypeForFile(slotPath(slot)).name();
+    }
+    return mimeType;
+}
+
+void FileSystemModel::statSlot(int slot) const {
+    // Only done when a row is shown, sorting uses the stats the workers collect
+    quint8& flags = m_flags[slot];
+    if (!(flags & StatFlag)) {
+        const QFileInfo info(slotPath(slot));
+        m_sizes[slot] = info.size();
+        m_modified[slot] = info.lastModified().toMSecsSinceEpoch();
+        flags = static_cast<quint8>(flags | StatFlag);
     }
+}
 
-    emit entriesChanged();
+FileSystemEntry* FileSystemModel::slotEntry(int slot) const {
+    auto& entry = m_objects[slot];
+    if (!entry) {
+        // Parented to the model, which owns it until the row goes away
+        entry = new FileSystemEntry(slotPath(slot), slotRelativePath(slot), const_cast<FileSystemModel*>(this));
+    }
+    return entry;
 }
 
-bool FileSystemModel::compareEntries(const FileSystemEntry* a, const FileSystemEntry* b) const {
-    if (a->isDir() != b->isDir()) {
-        return m_sortReverse ^ a->isDir();
+void FileSystemModel::sortRows() {
+    if (m_order.isEmpty()) {
+        return;
+    }
+
+    emit layoutAboutToBeChanged();
+
+    const auto oldOrder = m_order;
+    std::sort(m_order.begin(), m_order.end(), [this](int a, int b) {
+        return compareSlots(a, b);
+    });
+
+    const auto persistent = persistentIndexList();
+    QModelIndexList moved;
+    moved.reserve(persistent.size());
+    for (const auto& idx : persistent) {
+        moved << index(rowOf(oldOrder.at(idx.row())), idx.column());
+    }
+    changePersistentIndexList(persistent, moved);
+
+    emit layoutChanged();
+}
+
+int FileSystemModel::rowOf(int slot) const {
+    // Rows are kept sorted, so a binary search finds the row without walking the list
+    const auto it = std::lower_bound(m_order.cbegin(), m_order.cend(), slot, [this](int a, int b) {
+        return compareSlots(a, b);
+    });
+    if (it != m_order.cend() && *it == slot) {
+        return static_cast<int>(it - m_order.cbegin());
+    }
+    return static_cast<int>(m_order.indexOf(slot));
+}
+
+bool FileSystemModel::compareSlots(int a, int b) const {
+    const bool aIsDir = m_flags.at(a) & DirFlag;
+    const bool bIsDir = m_flags.at(b) & DirFlag;
+    if (aIsDir != bIsDir) {
+        return m_sortReverse ^ aIsDir;
+    }
+
+    int cmp = 0;
+    switch (m_sortMode) {
+    case Modified:
+        cmp = compareValues(m_modified.at(a), m_modified.at(b));
+        break;
+    case Size:
+        cmp = compareValues(m_sizes.at(a), m_sizes.at(b));
+        break;
+    case Type:
+        cmp = suffixOf(m_names.at(a)).compare(suffixOf(m_names.at(b)), Qt::CaseInsensitive);
+        break;
+    case Name:
+        break;
+    }
+    if (cmp == 0) {
+        cmp = m_sortKeys.at(a).compare(m_sortKeys.at(b));
     }
-    const auto cmp = a->relativePath().localeAwareCompare(b->relativePath());
     return m_sortReverse ? cmp > 0 : cmp < 0;
 }
 
@@ -1,8 +1,11 @@
 #pragma once
 
+#include "directorywalker.hpp"
+#include "inotifywatcher.hpp"
+#include <optional>
 #include <qabstractitemmodel.h>
+#include <qcollator.h>
 #include <qdir.h>
-#include <qfilesystemwatcher.h>
 #include <qfuture.h>
 #include <qimagereader.h>
 #include <qmimedatabase.h>
@@ -68,10 +71,18 @@ class FileSystemModel : public QAbstractListModel {
     Q_PROPERTY(bool watchChanges READ watchChanges WRITE setWatchChanges NOTIFY watchChangesChanged)
     Q_PROPERTY(bool showHidden READ showHidden WRITE setShowHidden NOTIFY showHiddenChanged)
     Q_PROPERTY(bool sortReverse READ sortReverse WRITE setSortReverse NOTIFY sortReverseChanged)
+    Q_PROPERTY(SortMode sortMode READ sortMode WRITE setSortMode NOTIFY sortModeChanged)
     Q_PROPERTY(Filter filter READ filter WRITE setFilter NOTIFY filterChanged)
     Q_PROPERTY(QStringList nameFilters READ nameFilters WRITE setNameFilters NOTIFY nameFiltersChanged)
+    Q_PROPERTY(bool snapshot READ snapshot WRITE setSnapshot NOTIFY snapshotChanged)
 
     Q_PROPERTY(QList<FileSystemEntry*> entries READ entries NOTIFY entriesChanged)
+    Q_PROPERTY(QStringList paths READ paths NOTIFY entriesChanged)
+    Q_PROPERTY(int count READ rowCount NOTIFY countChanged)
+    Q_PROPERTY(bool loading READ loading NOTIFY loadingChanged)
+    Q_PROPERTY(qreal progress READ progress NOTIFY progressChanged)
+    Q_PROPERTY(int watchCount READ watchCount NOTIFY watchCountChanged)
+    Q_PROPERTY(bool watchLimitReached READ watchLimitReached NOTIFY watchLimitReachedChanged)
 
 public:
     enum Filter {
@@ -82,6 +93,31 @@ public:
     };
     Q_ENUM(Filter)
 
+    // Directories always come first, ties are broken by name
+    enum SortMode {
+        Name,
+        Modified,
+        Size,
+        Type
+    };
+    Q_ENUM(SortMode)
+
+    enum Role {
+        EntryRole = Qt::UserRole,
+        PathRole,
+        RelativePathRole,
+        NameRole,
+        BaseNameRole,
+        ParentDirRole,
+        SuffixRole,
+        SizeRole,
+        ModifiedRole,
+        IsDirRole,
+        IsImageRole,
+        MimeTypeRole
+    };
+    Q_ENUM(Role)
+
     explicit FileSystemModel(QObject* parent = nullptr);
 
     int rowCount(const QModelIndex& parent = QModelIndex()) const override;
@@ -103,13 +139,28 @@ public:
     [[nodiscard]] bool sortReverse() const;
     void setSortReverse(bool sortReverse);
 
+    [[nodiscard]] SortMode sortMode() const;
+    void setSortMode(SortMode sortMode);
+
     [[nodiscard]] Filter filter() const;
     void setFilter(Filter filter);
 
     [[nodiscard]] QStringList nameFilters() const;
     void setNameFilters(const QStringList& nameFilters);
 
+    // Saves each completed scan to disk and restores it the next time the model starts out empty
+    [[nodiscard]] bool snapshot() const;
+    void setSnapshot(bool snapshot);
+
+    // Creates an entry object for every row, prefer the roles or paths where possible
     [[nodiscard]] QList<FileSystemEntry*> entries() const;
+    [[nodiscard]] QStringList paths() const;
+    [[nodiscard]] bool loading() const;
+    [[nodiscard]] qreal progress() const;
+
+    // Directories watched for changes. Past the watcher's cap the deepest ones are left unwatched
+    [[nodiscard]] int watchCount() const;
+    [[nodiscard]] bool watchLimitReached() const;
 
 signals:
     void pathChanged();
@@ -117,31 +168,119 @@ signals:
     void watchChangesChanged();
     void showHiddenChanged();
     void sortReverseChanged();
+    void sortModeChanged();
     void filterChanged();
     void nameFiltersChanged();
+    void snapshotChanged();
     void entriesChanged();
+    void countChanged();
+    void loadingChanged();
+    void progressChanged();
+    void watchCountChanged();
+    void watchLimitReachedChanged();
 
 private:
+    struct FileStat {
+        qint64 size = 0;
+        qint64 modified = 0; // ms since epoch
+    };
+
+    // Additions carry the entry type so inserting never needs a stat. Sort keys for them are built by the worker
+    // when it can, any missing ones are filled in on insertion. Stats come along while sorting by them, rows without
+    // one are stated by updateStats
+    struct Changes {
+        QSet<QString> removed;
+        QList<DirectoryWalker::Entry> added;
+        QList<QCollatorSortKey> sortKeys;
+        QList<FileStat> stats;
+    };
+
+    // A batch of watcher events, applied in order so a later removal can't overtake an earlier addition
+    struct Delta {
+        QStringList removed;
+        QStringList removedDirs;
+        QStringList changed;
+    };
+
+    enum SlotFlag : quint8 {
+        DirFlag = 1 << 0,
+        ImageKnownFlag = 1 << 1,
+        ImageFlag = 1 << 2,
+        StatFlag = 1 << 3
+    };
+
     QDir m_dir;
-    QFileSystemWatcher m_watcher;
-    QList<FileSystemEntry*> m_entries;
-    QHash<QString, QFuture<QPair<QSet<QString>, QSet<QString>>>> m_futures;
+    InotifyWatcher m_watcher;
+    QCollator m_collator;
+
+    // Rows are kept as parallel arrays indexed by slot, with freed slots reused. Parent directories are interned,
+    // so a row costs its name plus a few bytes. m_order holds the slots in row order
+    QList<QString> m_names;
+    QList<int> m_parents;
+    mutable QList<quint8> m_flags;
+    mutable QList<qint64> m_sizes;
+    mutable QList<qint64> m_modified;
+    mutable QList<QString> m_mimeTypes; // Empty until asked for
+    QList<QCollatorSortKey> m_sortKeys;
+    QList<int> m_freeSlots;
+    QList<int> m_order;
+    QHash<QString, int> m_index;
+    QStringList m_dirs;
+    QHash<QString, int> m_dirIds;
+    // Entry objects are only created when QML asks for them
+    mutable QHash<int, FileSystemEntry*> m_objects;
+
+    QList<Delta> m_deltas;
+    bool m_applyingDelta;
+    quint64 m_generation;
+    QHash<QString, QFuture<Changes>> m_futures;
+    bool m_updatingStats;
 
     QString m_path;
     bool m_recursive;
     bool m_watchChanges;
     bool m_showHidden;
     bool m_sortReverse;
+    SortMode m_sortMode;
     Filter m_filter;
     QStringList m_nameFilters;
+    bool m_snapshot;
+
+    bool m_loading;
+    qreal m_progress;
 
-    void watchDirIfRecursive(const QString& path);
     void update();
+    void setLoading(bool loading);
     void updateWatcher();
     void updateEntries();
-    void updateEntriesForDir(const QString& dir);
-    void applyChanges(const QSet<QString>& removedPaths, const QSet<QString>& addedPaths);
-    [[nodiscard]] bool compareEntries(const FileSystemEntry* a, const FileSystemEntry* b) const;
+    // restore publishes the saved snapshot first, if there is one, and lists only the directories changed since
+    void updateEntriesForDir(const QString& dir, bool restore);
+    [[nodiscard]] QString snapshotKey() const;
+    void onWatcherChanged(const QStringList& created, const QStringList& removed, const QStringList& modified,
+        const QStringList& removedDirs);
+    void applyNextDelta();
+    void applyChanges(const Changes& changes);
+    void clearSlots();
+
+    [[nodiscard]] bool sortedByStat() const;
+    void updateStats();
+    [[nodiscard]] static FileStat statPath(const QString& path);
+
+    int allocateSlot(
+        const DirectoryWalker::Entry& entry, const QCollatorSortKey& sortKey, const std::optional<FileStat>& fileStat);
+    void releaseSlot(int slot);
+    [[nodiscard]] QString slotPath(int slot) const;
+    [[nodiscard]] QString slotRelativePath(int slot) const;
+    [[nodiscard]] bool slotIsImage(int slot) const;
+    [[nodiscard]] qint64 slotSize(int slot) const;
+    [[nodiscard]] qint64 slotModified(int slot) const;
+    [[nodiscard]] QString slotMimeType(int slot) const;
+    void statSlot(int slot) const;
+    [[nodiscard]] FileSystemEntry* slotEntry(int slot) const;
+
+    void sortRows();
+    [[nodiscard]] int rowOf(int slot) const;
+    [[nodiscard]] bool compareSlots(int a, int b) const;
 };
 
 } // namespace caelestia::models
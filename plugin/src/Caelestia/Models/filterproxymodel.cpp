@@ -0,0 +1,248 @@
+#include "filterproxymodel.hpp"
+
+#include <algorithm>
+
+namespace caelestia::models {
+
+namespace {
+
+constexpr int MATCH_SCORE = 16;
+constexpr int CONSECUTIVE_BONUS = 16;
+constexpr int BOUNDARY_BONUS = 8;
+constexpr int MAX_GAP_PENALTY = 8;
+
+int roleForName(const QAbstractItemModel* model, const QString& roleName) {
+    if (!model) {
+        return -1;
+    }
+    return model->roleNames().key(roleName.toUtf8(), -1);
+}
+
+} // namespace
+
+FilterProxyModel::FilterProxyModel(QObject* parent)
+    : QSortFilterProxyModel(parent)
+    , m_mode(Substring)
+    , m_roleName("name")
+    , m_role(-1)
+    , m_sortRole(-1) {
+    connect(this, &QSortFilterProxyModel::sourceModelChanged, this, &FilterProxyModel::updateRole);
+
+    connect(this, &QAbstractItemModel::rowsInserted, this, &FilterProxyModel::countChanged);
+    connect(this, &QAbstractItemModel::rowsRemoved, this, &FilterProxyModel::countChanged);
+    connect(this, &QAbstractItemModel::modelReset, this, &FilterProxyModel::countChanged);
+    connect(this, &QAbstractItemModel::layoutChanged, this, &FilterProxyModel::countChanged);
+}
+
+QString FilterProxyModel::query() const {
+    return m_query;
+}
+
+void FilterProxyModel::setQuery(const QString& query) {
+    if (m_query == query) {
+        return;
+    }
+
+    m_query = query;
+    emit queryChanged();
+
+    updateFilter();
+}
+
+FilterProxyModel::Mode FilterProxyModel::mode() const {
+    return m_mode;
+}
+
+void FilterProxyModel::setMode(Mode mode) {
+    if (m_mode == mode) {
+        return;
+    }
+
+    m_mode = mode;
+    emit modeChanged();
+
+    updateFilter();
+}
+
+QString FilterProxyModel::roleName() const {
+    return m_roleName;
+}
+
+void FilterProxyModel::setRoleName(const QString& roleName) {
+    if (m_roleName == roleName) {
+        return;
+    }
+
+    m_roleName = roleName;
+    emit roleNameChanged();
+
+    updateRole();
+}
+
+QString FilterProxyModel::sortRoleName() const {
+    return m_sortRoleName;
+}
+
+void FilterProxyModel::setSortRoleName(const QString& sortRoleName) {
+    if (m_sortRoleName == sortRoleName) {
+        return;
+    }
+
+    m_sortRoleName = sortRoleName;
+    emit sortRoleNameChanged();
+
+    updateRole();
+}
+
+int FilterProxyModel::count() const {
+    return rowCount();
+}
+
+int FilterProxyModel::indexOf(const QString& roleName, const QVariant& value) const {
+    const int role = roleForName(sourceModel(), roleName);
+    if (role == -1) {
+        return -1;
+    }
+
+    for (int row = 0; row < rowCount(); ++row) {
+        if (index(row, 0).data(role) == value) {
+            return row;
+        }
+    }
+    return -1;
+}
+
+int FilterProxyModel::fuzzyScore(QStringView value, QStringView term) {
+    // Greedy left to right, rewarding runs of matches and matches at the start of words
+    int total = 0;
+    qsizetype last = -1;
+    for (const QChar c : term) {
+        const auto found = value.indexOf(c, last + 1);
+        if (found == -1) {
+            return -1;
+        }
+
+        total += MATCH_SCORE;
+        if (last != -1 && found == last + 1) {
+            total += CONSECUTIVE_BONUS;
+        } else if (last != -1) {
+            total -= static_cast<int>(qMin(found - last - 1, qsizetype(MAX_GAP_PENALTY)));
+        }
+        if (found == 0 || !value.at(found - 1).isLetterOrNumber()) {
+            total += BOUNDARY_BONUS;
+        }
+
+        last = found;
+    }
+    return qMax(0, total);
+}
+
+bool FilterProxyModel::filterAcceptsRow(int sourceRow, const QModelIndex& sourceParent) const {
+    if (m_terms.isEmpty()) {
+        return true;
+    }
+    if (m_role == -1) {
+        return false;
+    }
+
+    const QString value = sourceModel()->index(sourceRow, 0, sourceParent).data(m_role).toString();
+
+    switch (m_mode) {
+    case Substring:
+        return std::all_of(m_terms.cbegin(), m_terms.cend(), [&value](const QString& term) {
+            return value.contains(term, Qt::CaseInsensitive);
+        });
+    case Glob:
+        return m_glob.match(value).hasMatch();
+    case Fuzzy:
+        return score(value) != -1;
+    }
+
+    return false;
+}
+
+bool FilterProxyModel::lessThan(const QModelIndex& left, const QModelIndex& right) const {
+    if (m_mode != Fuzzy || m_terms.isEmpty()) {
+        const QVariant leftSort = left.data(m_sortRole);
+        const QVariant rightSort = right.data(m_sortRole);
+        if (leftSort.isValid() != rightSort.isValid()) {
+            return leftSort.isValid();
+        }
+
+        const auto order = QVariant::compare(leftSort, rightSort);
+        if (order != QPartialOrdering::Equivalent && order != QPartialOrdering::Unordered) {
+            return order == QPartialOrdering::Less;
+        }
+        return left.row() < right.row();
+    }
+
+    const QString leftValue = left.data(m_role).toString();
+    const QString rightValue = right.data(m_role).toString();
+
+    const int leftScore = score(leftValue);
+    const int rightScore = score(rightValue);
+    if (leftScore != rightScore) {
+        return leftScore > rightScore;
+    }
+
+    // Shorter values are closer matches for the same score, after that keep the source order
+    if (leftValue.size() != rightValue.size()) {
+        return leftValue.size() < rightValue.size();
+    }
+    return left.row() < right.row();
+}
+
+void FilterProxyModel::updateRole() {
+    m_role = roleForName(sourceModel(), m_roleName);
+    if (sourceModel() && m_role == -1) {
+        qWarning() << "FilterProxyModel::updateRole: source model has no role named" << m_roleName;
+    }
+
+    m_sortRole = m_sortRoleName.isEmpty() ? -1 : roleForName(sourceModel(), m_sortRoleName);
+    if (sourceModel() && !m_sortRoleName.isEmpty() && m_sortRole == -1) {
+        qWarning() << "FilterProxyModel::updateRole: source model has no role named" << m_sortRoleName;
+    }
+
+    updateFilter();
+}
+
+void FilterProxyModel::updateFilter() {
+    m_scores.clear();
+    m_terms = m_query.toLower().split(' ', Qt::SkipEmptyParts);
+    m_glob = m_mode == Glob ? QRegularExpression::fromWildcard(m_query.trimmed(), Qt::CaseInsensitive,
+                                  QRegularExpression::NonPathWildcardConversion)
+                            : QRegularExpression();
+
+    invalidate();
+
+    // Fuzzy matches are ranked, anything else follows the sort role or keeps the source's order. The sort role also
+    // tells the base class which data changes need the rows to be sorted again
+    const bool ranked = m_mode == Fuzzy && !m_terms.isEmpty();
+    setSortRole(ranked ? m_role : m_sortRole);
+    sort(ranked || m_sortRole != -1 ? 0 : -1);
+
+    emit countChanged();
+}
+
+int FilterProxyModel::score(const QString& value) const {
+    const auto it = m_scores.constFind(value);
+    if (it != m_scores.cend()) {
+        return *it;
+    }
+
+    const QString lower = value.toLower();
+    int total = 0;
+    for (const auto& term : m_terms) {
+        const int termScore = fuzzyScore(lower, term);
+        if (termScore == -1) {
+            total = -1;
+            break;
+        }
+        total += termScore;
+    }
+
+    m_scores.insert(value, total);
+    return total;
+}
+
+} // namespace caelestia::models
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <qhash.h>
+#include <qqmlintegration.h>
+#include <qregularexpression.h>
+#include <qsortfilterproxymodel.h>
+
+namespace caelestia::models {
+
+// Filters the rows of another model by one of its roles, so views can search a large model without copying its rows
+// into JS. In fuzzy mode matches are ranked best first, otherwise rows are ordered by the sort role if there is one
+// and kept in the source order if not
+class FilterProxyModel : public QSortFilterProxyModel {
+    Q_OBJECT
+    QML_ELEMENT
+
+    Q_PROPERTY(QString query READ query WRITE setQuery NOTIFY queryChanged)
+    Q_PROPERTY(Mode mode READ mode WRITE setMode NOTIFY modeChanged)
+    Q_PROPERTY(QString roleName READ roleName WRITE setRoleName NOTIFY roleNameChanged)
+    // Ascending, rows without a value for it last. Empty keeps the source order
+    Q_PROPERTY(QString sortRoleName READ sortRoleName WRITE setSortRoleName NOTIFY sortRoleNameChanged)
+    Q_PROPERTY(int count READ count NOTIFY countChanged)
+
+public:
+    enum Mode {
+        // Every whitespace separated term is contained in the value
+        Substring,
+        // The whole value matches the pattern, * also matches across /
+        Glob,
+        // Every term's characters appear in order, ranked by how closely they do
+        Fuzzy
+    };
+    Q_ENUM(Mode)
+
+    explicit FilterProxyModel(QObject* parent = nullptr);
+
+    [[nodiscard]] QString query() const;
+    void setQuery(const QString& query);
+
+    [[nodiscard]] Mode mode() const;
+    void setMode(Mode mode);
+
+    [[nodiscard]] QString roleName() const;
+    void setRoleName(const QString& roleName);
+
+    [[nodiscard]] QString sortRoleName() const;
+    void setSortRoleName(const QString& sortRoleName);
+
+    [[nodiscard]] int count() const;
+
+    // Row of the first match whose role is value, -1 if there is none
+    Q_INVOKABLE int indexOf(const QString& roleName, const QVariant& value) const;
+
+    // Fuzzy score of value for a single lowercase term, -1 if the term doesn't match
+    [[nodiscard]] static int fuzzyScore(QStringView value, QStringView term);
+
+signals:
+    void queryChanged();
+    void modeChanged();
+    void roleNameChanged();
+    void sortRoleNameChanged();
+    void countChanged();
+
+protected:
+    bool filterAcceptsRow(int sourceRow, const QModelIndex& sourceParent) const override;
+    bool lessThan(const QModelIndex& left, const QModelIndex& right) const override;
+
+private:
+    QString m_query;
+    Mode m_mode;
+    QString m_roleName;
+    QString m_sortRoleName;
+
+    QStringList m_terms;
+    QRegularExpression m_glob;
+    int m_role;
+    int m_sortRole;
+    mutable QHash<QString, int> m_scores;
+
+    void updateRole();
+    void updateFilter();
+    [[nodiscard]] int score(const QString& value) const;
+};
+
+} // namespace caelestia::models
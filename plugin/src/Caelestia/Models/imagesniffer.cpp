@@ -0,0 +1,140 @@
+#include "imagesniffer.hpp"
+
+#include <fcntl.h>
+#include <qfile.h>
+#include <qimagereader.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace caelestia::models {
+
+namespace {
+
+constexpr qsizetype HEADER_SIZE = 32;
+constexpr qsizetype MAX_ENTRIES = 65536;
+
+bool matches(const QByteArray& header, qsizetype offset, QByteArrayView magic) {
+    return header.size() >= offset + magic.size() && QByteArrayView(header).sliced(offset, magic.size()) == magic;
+}
+
+QSet<QByteArray> supportedFormats() {
+    const auto formats = QImageReader::supportedImageFormats();
+    return QSet<QByteArray>(formats.cbegin(), formats.cend());
+}
+
+} // namespace
+
+ImageSniffer::ImageSniffer()
+    : m_supportedFormats(supportedFormats()) {}
+
+ImageSniffer& ImageSniffer::instance() {
+    static ImageSniffer instance;
+    return instance;
+}
+
+bool ImageSniffer::isImage(const QString& path) {
+    const int fd = open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    const Key key{ st.st_dev, st.st_ino, static_cast<qint64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec };
+    if (const auto cached = find(key)) {
+        close(fd);
+        return *cached;
+    }
+
+    QByteArray header(HEADER_SIZE, Qt::Uninitialized);
+    const ssize_t length = pread(fd, header.data(), static_cast<size_t>(HEADER_SIZE), 0);
+    close(fd);
+    header.resize(qMax(ssize_t(0), length));
+
+    // A known signature is decisive, only unrecognised headers need the plugins to take a look
+    const QByteArray format = formatFromHeader(header);
+    const bool isImage = format.isEmpty() ? QImageReader(path).canRead() : m_supportedFormats.contains(format);
+
+    insert(key, isImage);
+    return isImage;
+}
+
+QByteArray ImageSniffer::formatFromHeader(const QByteArray& header) {
+    if (matches(header, 0, QByteArrayView("\x89PNG\r\n\x1a\n", 8))) {
+        return "png";
+    }
+    if (matches(header, 0, QByteArrayView("\xff\xd8\xff", 3))) {
+        return "jpeg";
+    }
+    if (matches(header, 0, "GIF87a") || matches(header, 0, "GIF89a")) {
+        return "gif";
+    }
+    if (matches(header, 0, "RIFF") && matches(header, 8, "WEBP")) {
+        return "webp";
+    }
+    if (matches(header, 0, QByteArrayView("\xff\x0a", 2)) ||
+        matches(header, 0, QByteArrayView("\0\0\0\x0cJXL \r\n\x87\n", 12))) {
+        return "jxl";
+    }
+    if (matches(header, 0, QByteArrayView("II*\0", 4)) || matches(header, 0, QByteArrayView("MM\0*", 4))) {
+        return "tiff";
+    }
+    if (matches(header, 0, "qoif")) {
+        return "qoi";
+    }
+    if (matches(header, 0, QByteArrayView("\0\0\1\0", 4))) {
+        return "ico";
+    }
+
+    // ISO base media files, the major brand tells AVIF from HEIF. Generic brands could be either
+    if (matches(header, 4, "ftyp")) {
+        if (matches(header, 8, "avif") || matches(header, 8, "avis")) {
+            return "avif";
+        }
+        if (matches(header, 8, "heic") || matches(header, 8, "heix") || matches(header, 8, "hevc") ||
+            matches(header, 8, "hevx")) {
+            return "heif";
+        }
+        return QByteArray();
+    }
+
+    // Only two bytes of magic, so also check the DIB header size is one of the known versions
+    if (matches(header, 0, "BM") && header.size() >= 18) {
+        const auto dibSize = static_cast<quint32>(static_cast<uchar>(header.at(14))) |
+                             static_cast<quint32>(static_cast<uchar>(header.at(15))) << 8 |
+                             static_cast<quint32>(static_cast<uchar>(header.at(16))) << 16 |
+                             static_cast<quint32>(static_cast<uchar>(header.at(17))) << 24;
+        if (dibSize == 12 || dibSize == 40 || dibSize == 52 || dibSize == 56 || dibSize == 64 || dibSize == 108 ||
+            dibSize == 124) {
+            return "bmp";
+        }
+    }
+
+    return QByteArray();
+}
+
+std::optional<bool> ImageSniffer::find(const Key& key) {
+    QMutexLocker locker(&m_mutex);
+
+    const auto it = m_results.constFind(key);
+    if (it == m_results.cend()) {
+        return std::nullopt;
+    }
+    return *it;
+}
+
+void ImageSniffer::insert(const Key& key, bool isImage) {
+    QMutexLocker locker(&m_mutex);
+
+    // Stale keys are never looked up again once a file changes, so just start over rather than track usage
+    if (m_results.size() >= MAX_ENTRIES) {
+        m_results.clear();
+    }
+    m_results.insert(key, isImage);
+}
+
+} // namespace caelestia::models
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <optional>
+#include <qbytearray.h>
+#include <qhash.h>
+#include <qmutex.h>
+#include <qset.h>
+#include <qstring.h>
+#include <sys/types.h>
+
+namespace caelestia::models {
+
+// Decides whether a file is a readable image from its first bytes, so scanning a directory doesn't have to open
+// every file through QImageReader. Results are cached by inode and modification time
+class ImageSniffer {
+public:
+    ImageSniffer(const ImageSniffer&) = delete;
+    ImageSniffer& operator=(const ImageSniffer&) = delete;
+
+    static ImageSniffer& instance();
+
+    // Thread safe. Falls back to QImageReader for formats without a signature, e.g. SVG or TGA
+    [[nodiscard]] bool isImage(const QString& path);
+
+    // The QImageReader format name for a known signature, empty if the header is not recognised
+    [[nodiscard]] static QByteArray formatFromHeader(const QByteArray& header);
+
+private:
+    struct Key {
+        dev_t device;
+        ino_t inode;
+        qint64 mtime;
+
+        bool operator==(const Key& other) const = default;
+    };
+
+    friend size_t qHash(const Key& key, size_t seed) {
+        return qHashMulti(seed, key.device, key.inode, key.mtime);
+    }
+
+    ImageSniffer();
+
+    QMutex m_mutex;
+    QHash<Key, bool> m_results;
+    const QSet<QByteArray> m_supportedFormats;
+
+    [[nodiscard]] std::optional<bool> find(const Key& key);
+    void insert(const Key& key, bool isImage);
+};
+
+} // namespace caelestia::models
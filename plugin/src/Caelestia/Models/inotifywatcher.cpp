@@ -0,0 +1,425 @@
+#include "inotifywatcher.hpp"
+
+#include "directorywalker.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <qdir.h>
+#include <qfile.h>
+#include <qfileinfo.h>
+#include <qtconcurrentrun.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace caelestia::models {
+
+namespace {
+
+constexpr int FLUSH_INTERVAL = 100; // ms
+constexpr std::size_t READ_BUFFER_SIZE = 64 * 1024;
+// The kernel default before 5.11, assumed when the real limit can't be read
+constexpr int DEFAULT_USER_WATCHES = 8192;
+constexpr int WATCH_CAP = 65536;
+
+// IN_CLOSE_WRITE rather than IN_MODIFY, so a file being written is reported once it is complete
+constexpr quint32 WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF |
+                               IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+struct Listing {
+    QStringList dirs;
+    QStringList entries;
+};
+
+// Every directory the walker descends into, and with withEntries everything below dir as well
+Listing listTree(const QString& dir, bool showHidden, bool withEntries) {
+    Listing listing;
+    DirectoryWalker::walk(
+        dir, true, showHidden,
+        [withEntries](const DirectoryWalker::Entry&) {
+            return withEntries;
+        },
+        []() {
+            return false;
+        },
+        [&listing](QList<DirectoryWalker::Entry>&& chunk, qreal) {
+            for (const auto& entry : std::as_const(chunk)) {
+                listing.entries << entry.path;
+            }
+        },
+        [&listing](const QString& listed, qint64, QStringList&&) {
+            listing.dirs << listed;
+        });
+    return listing;
+}
+
+// Half of what the user may have, the rest is left for other programs
+int defaultMaxWatches() {
+    QFile file("/proc/sys/fs/inotify/max_user_watches");
+    bool ok = false;
+    int limit = 0;
+    if (file.open(QIODevice::ReadOnly)) {
+        limit = file.readAll().trimmed().toInt(&ok);
+    }
+    if (!ok || limit <= 0) {
+        limit = DEFAULT_USER_WATCHES;
+    }
+    return qBound(1, limit / 2, WATCH_CAP);
+}
+
+int depthOf(const QString& path) {
+    return static_cast<int>(path.count('/'));
+}
+
+} // namespace
+
+InotifyWatcher::InotifyWatcher(QObject* parent)
+    : QObject(parent)
+    , m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+    , m_notifier(nullptr)
+    , m_recursive(false)
+    , m_showHidden(false)
+    , m_generation(0)
+    , m_maxWatches(defaultMaxWatches())
+    , m_limitReached(false)
+    , m_reportedCount(0) {
+    if (m_fd == -1) {
+        qWarning() << "InotifyWatcher: failed to initialise inotify -" << qt_error_string(errno);
+        return;
+    }
+
+    m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &InotifyWatcher::readEvents);
+
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(FLUSH_INTERVAL);
+    connect(&m_flushTimer, &QTimer::timeout, this, &InotifyWatcher::flush);
+}
+
+InotifyWatcher::~InotifyWatcher() {
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+void InotifyWatcher::watch(const QString& root, bool recursive, bool showHidden) {
+    clear();
+
+    m_root = root.isEmpty() ? root : QDir::cleanPath(root);
+    m_recursive = recursive;
+    m_showHidden = showHidden;
+
+    if (m_fd == -1 || m_root.isEmpty()) {
+        return;
+    }
+
+    addWatch(m_root);
+    if (recursive) {
+        watchSubdirs(m_root);
+    }
+
+    updateWatchCount();
+}
+
+void InotifyWatcher::clear() {
+    for (auto it = m_dirs.cbegin(); it != m_dirs.cend(); ++it) {
+        inotify_rm_watch(m_fd, it.key());
+    }
+    m_dirs.clear();
+    m_watches.clear();
+
+    m_created.clear();
+    m_removed.clear();
+    m_removedDirs.clear();
+    m_modified.clear();
+    m_flushTimer.stop();
+
+    // Invalidates any subdirectory listing still in flight
+    ++m_generation;
+
+    setLimitReached(false);
+    updateWatchCount();
+}
+
+QStringList InotifyWatcher::directories() const {
+    return m_watches.keys();
+}
+
+int InotifyWatcher::watchCount() const {
+    return static_cast<int>(m_watches.size());
+}
+
+int InotifyWatcher::maxWatches() const {
+    return m_maxWatches;
+}
+
+bool InotifyWatcher::limitReached() const {
+    return m_limitReached;
+}
+
+void InotifyWatcher::readEvents() {
+    alignas(inotify_event) char buffer[READ_BUFFER_SIZE];
+
+    for (;;) {
+        const ssize_t length = read(m_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            // EAGAIN once the queue is drained
+            break;
+        }
+
+        for (const char* ptr = buffer; ptr < buffer + length;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Existing watches are intact, but directories created or removed meanwhile were missed. Listing
+                // the tree again adds the missing watches and drops the stale ones, the rest are left alone
+                qWarning() << "InotifyWatcher: event queue overflowed, rescanning" << m_root;
+                m_created.clear();
+                m_removed.clear();
+                m_removedDirs.clear();
+                m_modified.clear();
+                m_flushTimer.stop();
+                if (m_recursive) {
+                    watchSubdirs(m_root);
+                }
+                emit overflowed();
+                return;
+            }
+
+            const QString dir = m_dirs.value(event->wd);
+            if (dir.isEmpty()) {
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED) {
+                // Removed by the kernel since the directory is gone
+                m_dirs.remove(event->wd);
+                m_watches.remove(dir);
+                continue;
+            }
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // Subdirectories are reported through their parent, only the root needs handling here
+                if (dir == m_root) {
+                    recordRemoved(dir, true);
+                }
+                continue;
+            }
+
+            if (event->len == 0) {
+                continue;
+            }
+
+            const QString name = QString::fromUtf8(event->name);
+            if (!m_showHidden && name.startsWith('.')) {
+                continue;
+            }
+
+            const QString path = dir + "/" + name;
+            const bool isDir = event->mask & IN_ISDIR;
+
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                recordCreated(path);
+                if (isDir && m_recursive) {
+                    // Anything created before the watch is in place would otherwise be missed
+                    addTree(path);
+                }
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                recordRemoved(path, isDir);
+                if (isDir) {
+                    removeTree(path);
+                }
+            } else if (event->mask & IN_CLOSE_WRITE) {
+                recordModified(path);
+            }
+        }
+    }
+
+    updateWatchCount();
+}
+
+bool InotifyWatcher::addWatch(const QString& dir) {
+    if (m_watches.contains(dir)) {
+        return true;
+    }
+
+    // Warned about once, there may be many more directories that don't fit
+    if (m_watches.size() >= m_maxWatches) {
+        if (!m_limitReached) {
+            qWarning() << "InotifyWatcher::addWatch: reached the cap of" << m_maxWatches
+                       << "watches, changes in further directories under" << m_root << "won't be seen";
+            setLimitReached(true);
+        }
+        return false;
+    }
+
+    const int wd = inotify_add_watch(m_fd, QFile::encodeName(dir).constData(), WATCH_MASK);
+    if (wd == -1) {
+        // A directory that is already gone again (ENOENT) has its removal reported through the parent
+        if (errno == ENOSPC) {
+            if (!m_limitReached) {
+                qWarning() << "InotifyWatcher::addWatch: out of inotify watches after" << m_watches.size()
+                           << "- raise fs.inotify.max_user_watches to watch everything under" << m_root;
+                setLimitReached(true);
+            }
+        } else if (errno != ENOENT) {
+            qWarning() << "InotifyWatcher::addWatch: failed to watch" << dir << "-" << qt_error_string(errno);
+        }
+        return false;
+    }
+
+    m_dirs.insert(wd, dir);
+    m_watches.insert(dir, wd);
+    return true;
+}
+
+void InotifyWatcher::addTree(const QString& dir) {
+    // Watched straight away so nothing created in it from now on is missed. Whatever it already holds (e.g. an
+    // archive unpacked or a tree moved in) is listed off the GUI thread and reported as created
+    addWatch(dir);
+    updateWatchCount();
+
+    const auto generation = m_generation;
+    QtConcurrent::run(&listTree, dir, m_showHidden, true).then(this, [generation, this](const Listing& listing) {
+        if (generation != m_generation) {
+            return;
+        }
+
+        addWatches(listing.dirs);
+        for (const auto& path : listing.entries) {
+            recordCreated(path);
+        }
+    });
+}
+
+void InotifyWatcher::removeTree(const QString& dir) {
+    const QString prefix = dir + "/";
+    for (auto it = m_watches.begin(); it != m_watches.end();) {
+        if (it.key() == dir || it.key().startsWith(prefix)) {
+            inotify_rm_watch(m_fd, it.value());
+            m_dirs.remove(it.value());
+            it = m_watches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void InotifyWatcher::watchSubdirs(const QString& dir) {
+    // Listing a large tree is slow, so it happens off the GUI thread and the watches are added once it is done
+    const auto generation = m_generation;
+    QtConcurrent::run(&listTree, dir, m_showHidden, false).then(this, [dir, generation, this](const Listing& listing) {
+        if (generation != m_generation) {
+            return;
+        }
+
+        // Watches for directories that are gone but whose removal was missed. Anything created since the listing is
+        // still there, so only directories that no longer exist are dropped
+        const QSet<QString> listed(listing.dirs.cbegin(), listing.dirs.cend());
+        const QString prefix = dir + "/";
+        for (auto it = m_watches.begin(); it != m_watches.end();) {
+            if (it.key().startsWith(prefix) && !listed.contains(it.key()) && !QFileInfo(it.key()).isDir()) {
+                inotify_rm_watch(m_fd, it.value());
+                m_dirs.remove(it.value());
+                it = m_watches.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        addWatches(listing.dirs);
+    });
+}
+
+void InotifyWatcher::addWatches(QStringList dirs) {
+    // When not everything fits, the directories nearest the root are the ones worth watching
+    if (m_watches.size() + dirs.size() > m_maxWatches) {
+        std::stable_sort(dirs.begin(), dirs.end(), [](const QString& a, const QString& b) {
+            return depthOf(a) < depthOf(b);
+        });
+    }
+
+    for (const auto& dir : std::as_const(dirs)) {
+        if (!addWatch(dir) && m_limitReached) {
+            break;
+        }
+    }
+
+    updateWatchCount();
+}
+
+void InotifyWatcher::setLimitReached(bool limitReached) {
+    if (m_limitReached != limitReached) {
+        m_limitReached = limitReached;
+        emit limitReachedChanged();
+    }
+}
+
+void InotifyWatcher::updateWatchCount() {
+    // Watches come and go in bulk, so the count is only reported once a batch is done
+    const auto count = watchCount();
+    if (m_reportedCount != count) {
+        m_reportedCount = count;
+        emit watchCountChanged();
+    }
+}
+
+void InotifyWatcher::recordCreated(const QString& path) {
+    // Replaced within the window, e.g. an editor saving through a temporary file
+    if (m_removed.remove(path)) {
+        m_modified.insert(path);
+    } else {
+        m_created.insert(path);
+    }
+
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void InotifyWatcher::recordRemoved(const QString& path, bool isDir) {
+    m_modified.remove(path);
+
+    // Kept even if the directory comes back within the window, whatever was below it is gone all the same
+    if (isDir) {
+        m_removedDirs.insert(path);
+    }
+
+    // Created and removed within the window, nobody needs to know
+    if (!m_created.remove(path)) {
+        m_removed.insert(path);
+    }
+
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void InotifyWatcher::recordModified(const QString& path) {
+    if (!m_created.contains(path)) {
+        m_modified.insert(path);
+    }
+
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void InotifyWatcher::flush() {
+    if (m_created.isEmpty() && m_removed.isEmpty() && m_modified.isEmpty() && m_removedDirs.isEmpty()) {
+        return;
+    }
+
+    const QStringList created(m_created.cbegin(), m_created.cend());
+    const QStringList removed(m_removed.cbegin(), m_removed.cend());
+    const QStringList modified(m_modified.cbegin(), m_modified.cend());
+    const QStringList removedDirs(m_removedDirs.cbegin(), m_removedDirs.cend());
+
+    m_created.clear();
+    m_removed.clear();
+    m_modified.clear();
+    m_removedDirs.clear();
+
+    emit changed(created, removed, modified, removedDirs);
+}
+
+} // namespace caelestia::models
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <qhash.h>
+#include <qobject.h>
+#include <qset.h>
+#include <qsocketnotifier.h>
+#include <qtimer.h>
+
+namespace caelestia::models {
+
+// Watches a directory, and optionally every directory below it, through a single inotify instance. Events are
+// reported per path and coalesced over a short window, so bursts such as copying many files arrive as one change
+class InotifyWatcher : public QObject {
+    Q_OBJECT
+
+public:
+    explicit InotifyWatcher(QObject* parent = nullptr);
+    ~InotifyWatcher() override;
+
+    // Replaces whatever was watched before. An empty root stops watching
+    void watch(const QString& root, bool recursive, bool showHidden);
+    void clear();
+
+    [[nodiscard]] QStringList directories() const;
+
+    // Directories are watched up to a cap derived from the user's inotify limit, which other programs share
+    [[nodiscard]] int watchCount() const;
+    [[nodiscard]] int maxWatches() const;
+    // Whether directories went unwatched since the last watch(), because of the cap or the kernel's own limit
+    [[nodiscard]] bool limitReached() const;
+
+signals:
+    // Paths are absolute. A removed directory is reported on its own, whatever was below it is gone too, and is also
+    // listed in removedDirs, which may name directories that were replaced within the window. Directories that appear
+    // with contents (e.g. moved in) have their contents reported as created
+    void changed(const QStringList& created, const QStringList& removed, const QStringList& modified,
+        const QStringList& removedDirs);
+    // The kernel queue overflowed and events were lost, anything under the root may have changed
+    void overflowed();
+    void watchCountChanged();
+    void limitReachedChanged();
+
+private:
+    int m_fd;
+    QSocketNotifier* m_notifier;
+    QTimer m_flushTimer;
+
+    QString m_root;
+    bool m_recursive;
+    bool m_showHidden;
+    quint64 m_generation;
+
+    const int m_maxWatches;
+    bool m_limitReached;
+    int m_reportedCount;
+
+    QHash<int, QString> m_dirs;
+    QHash<QString, int> m_watches;
+
+    QSet<QString> m_created;
+    QSet<QString> m_removed;
+    QSet<QString> m_removedDirs;
+    QSet<QString> m_modified;
+
+    void readEvents();
+    bool addWatch(const QString& dir);
+    void addTree(const QString& dir);
+    void removeTree(const QString& dir);
+    void watchSubdirs(const QString& dir);
+    void addWatches(QStringList dirs);
+    void setLimitReached(bool limitReached);
+    void updateWatchCount();
+
+    void recordCreated(const QString& path);
+    void recordRemoved(const QString& path, bool isDir);
+    void recordModified(const QString& path);
+    void flush();
+};
+
+} // namespace caelestia::models
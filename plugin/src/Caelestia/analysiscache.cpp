@@ -0,0 +1,129 @@
+#include "analysiscache.hpp"
+
+#include <qcryptographichash.h>
+#include <qdatastream.h>
+#include <qdatetime.h>
+#include <qdir.h>
+#include <qfile.h>
+#include <qfileinfo.h>
+#include <qsavefile.h>
+#include <qstandardpaths.h>
+#include <qthreadpool.h>
+#include <qtimezone.h>
+
+namespace caelestia {
+
+namespace {
+
+constexpr int MEMORY_ENTRIES = 512;
+constexpr quint32 FILE_MAGIC = 0x43414e41; // "CANA"
+// Bump whenever the analysis itself changes so stale results are never reused
+constexpr int ANALYSIS_VERSION = 3;
+
+} // namespace
+
+AnalysisCache::AnalysisCache()
+    : m_results(MEMORY_ENTRIES)
+    , m_dir(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/caelestia/imageanalyser") {}
+
+AnalysisCache& AnalysisCache::instance() {
+    static AnalysisCache instance;
+    return instance;
+}
+
+QString AnalysisCache::key(const QString& path, int rescaleSize, int paletteSize, const QRectF& region) {
+    const QFileInfo info(path);
+    if (!info.isFile()) {
+        return QString();
+    }
+
+    // What is analysed comes before the |, the file is named after it. What decides whether a result is still valid
+    // comes after, so a newer result replaces the file of an outdated one
+    return QStringLiteral("%1:%2:%3,%4,%5,%6:%7|%8:%9:%10")
+        .arg(rescaleSize)
+        .arg(paletteSize)
+        .arg(region.x())
+        .arg(region.y())
+        .arg(region.width())
+        .arg(region.height())
+        .arg(info.absoluteFilePath())
+        .arg(ANALYSIS_VERSION)
+        .arg(info.lastModified(QTimeZone::UTC).toMSecsSinceEpoch())
+        .arg(info.size());
+}
+
+std::optional<AnalysisResult> AnalysisCache::find(const QString& key) {
+    if (key.isEmpty()) {
+        return std::nullopt;
+    }
+
+    {
+        const QMutexLocker locker(&m_mutex);
+        if (const auto* result = m_results.object(key)) {
+            return *result;
+        }
+    }
+
+    // Read without the lock, so analysers on other threads don't queue up behind the disk
+    QFile file(filePath(key));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return std::nullopt;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+
+    quint32 magic = 0;
+    QString storedKey;
+    AnalysisResult result;
+    stream >> magic >> storedKey >> result.dominantColour >> result.luminance >> result.palette;
+
+    // The file name is only a hash, so the full key guards against collisions
+    if (stream.status() != QDataStream::Ok || magic != FILE_MAGIC || storedKey != key) {
+        return std::nullopt;
+    }
+
+    const QMutexLocker locker(&m_mutex);
+    m_results.insert(key, new AnalysisResult(result));
+    return result;
+}
+
+void AnalysisCache::insert(const QString& key, const AnalysisResult& result) {
+    if (key.isEmpty()) {
+        return;
+    }
+
+    {
+        const QMutexLocker locker(&m_mutex);
+        m_results.insert(key, new AnalysisResult(result));
+    }
+
+    QThreadPool::globalInstance()->start([key, result, dir = m_dir, path = filePath(key)]() {
+        if (!QDir().mkpath(dir)) {
+            qWarning() << "AnalysisCache::insert: failed to create cache dir" << dir;
+            return;
+        }
+
+        QSaveFile file(path);
+        if (!file.open(QIODevice::WriteOnly)) {
+            qWarning() << "AnalysisCache::insert: failed to open" << path << "-" << file.errorString();
+            return;
+        }
+
+        QDataStream stream(&file);
+        stream.setVersion(QDataStream::Qt_6_0);
+        stream << FILE_MAGIC << key << result.dominantColour << result.luminance << result.palette;
+
+        if (!file.commit()) {
+            qWarning() << "AnalysisCache::insert: failed to write" << path << "-" << file.errorString();
+        }
+    });
+}
+
+QString AnalysisCache::filePath(const QString& key) const {
+    const QString analysis = key.left(key.lastIndexOf('|'));
+    const auto hash = QCryptographicHash::hash(analysis.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return m_dir + "/" + QString::fromLatin1(hash) + ".bin";
+}
+
+} // namespace caelestia
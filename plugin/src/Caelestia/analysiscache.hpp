@@ -0,0 +1,46 @@
+#pragma once
+
+#include <optional>
+#include <qcache.h>
+#include <qcolor.h>
+#include <qlist.h>
+#include <qmutex.h>
+#include <qrect.h>
+#include <qstring.h>
+
+namespace caelestia {
+
+struct AnalysisResult {
+    QColor dominantColour;
+    qreal luminance = 0.0;
+    QList<QColor> palette;
+};
+
+class AnalysisCache {
+public:
+    AnalysisCache(const AnalysisCache&) = delete;
+    AnalysisCache& operator=(const AnalysisCache&) = delete;
+
+    static AnalysisCache& instance();
+
+    // Identifies an analysis by the file's path, modification time and size plus the analysis parameters.
+    // Empty if the file does not exist, in which case nothing is cached. On disk there is one result per path and
+    // parameters, the latest one stored
+    [[nodiscard]] static QString key(const QString& path, int rescaleSize, int paletteSize, const QRectF& region);
+
+    // Looks in memory, then on disk. Cheap enough to call from the GUI thread
+    [[nodiscard]] std::optional<AnalysisResult> find(const QString& key);
+    // Stores in memory immediately and writes to disk in the background
+    void insert(const QString& key, const AnalysisResult& result);
+
+private:
+    AnalysisCache();
+
+    QMutex m_mutex;
+    QCache<QString, AnalysisResult> m_results;
+    QString m_dir;
+
+    [[nodiscard]] QString filePath(const QString& key) const;
+};
+
+} // namespace caelestia
@@ -3,13 +3,29 @@
 #include <QtConcurrent/qtconcurrentrun.h>
 #include <QtQuick/qquickitemgrabresult.h>
 #include <QtQuick/qquickwindow.h>
+#include <qbuffer.h>
+#include <qclipboard.h>
 #include <qdir.h>
 #include <qfileinfo.h>
 #include <qfuturewatcher.h>
+#include <qguiapplication.h>
+#include <qimagewriter.h>
+#include <qmimedata.h>
+#include <qmimedatabase.h>
+#include <qqmlcomponent.h>
 #include <qqmlengine.h>
+#include <qsavefile.h>
 
 namespace caelestia {
 
+namespace {
+
+// PNG quality maps onto the zlib level, 80 is level 1. Much faster than the default for large screenshots at a
+// modest size cost
+constexpr int FAST_PNG_QUALITY = 80;
+
+} // namespace
+
 void CUtils::saveItem(QQuickItem* target, const QUrl& path) {
     this->saveItem(target, path, QRect(), QJSValue(), QJSValue());
 }
@@ -31,63 +47,83 @@ void CUtils::saveItem(QQuickItem* target, const QUrl& path, const QRect& rect, Q
 }
 
 void CUtils::saveItem(QQuickItem* target, const QUrl& path, const QRect& rect, QJSValue onSaved, QJSValue onFailed) {
-    if (!target) {
-        qWarning() << "CUtils::saveItem: a target is required";
-        return;
-    }
+    auto* engine = qmlEngine(this);
 
     if (!path.isLocalFile()) {
         qWarning() << "CUtils::saveItem:" << path << "is not a local file";
+        if (onFailed.isCallable()) {
+            onFailed.call({ engine->toScriptValue(QVariant::fromValue(path)) });
+        }
         return;
     }
 
-    if (!target->window()) {
-        qWarning() << "CUtils::saveItem: unable to save target" << target << "without a window";
+    SaveOptions options;
+    options.path = path;
+    options.rect = rect;
+
+    save(target, options, [=](const SaveResult& result) {
+        if (result.error.isEmpty()) {
+            if (onSaved.isCallable()) {
+                onSaved.call({ QJSValue(path.toLocalFile()), engine->toScriptValue(QVariant::fromValue(path)) });
+            }
+        } else {
+            qWarning() << "CUtils::saveItem: failed to save" << path << "-" << result.error;
+            if (onFailed.isCallable()) {
+                onFailed.call({ engine->toScriptValue(QVariant::fromValue(path)) });
+            }
+        }
+    });
+}
+
+void CUtils::saveItemWith(QQuickItem* target, const QVariantMap& options, QJSValue onSaved, QJSValue onFailed) {
+    SaveOptions opts;
+    opts.path = options.value("path").toUrl();
+    opts.rect = options.value("rect").toRectF().toRect();
+    opts.scale = options.value("scale", 1.0).toReal();
+    opts.format = options.value("format").toString().toLatin1();
+    opts.quality = options.value("quality", -1).toInt();
+    opts.clipboard = options.value("clipboard").toBool();
+    opts.data = options.value("data").toBool();
+
+    // Every failure, including invalid options, ends up here so callers can rely on onFailed
+    const auto fail = [onFailed](const QString& error) {
+        qWarning() << "CUtils::saveItemWith:" << error;
+        if (onFailed.isCallable()) {
+            onFailed.call({ QJSValue(error) });
+        }
+    };
+
+    if (!opts.path.isEmpty() && !opts.path.isLocalFile()) {
+        fail(opts.path.toString() + " is not a local file");
         return;
     }
 
-    auto scaledRect = rect;
-    const qreal scale = target->window()->devicePixelRatio();
-    if (rect.isValid() && !qFuzzyCompare(scale + 1.0, 2.0)) {
-        scaledRect =
-            QRectF(rect.left() * scale, rect.top() * scale, rect.width() * scale, rect.height() * scale).toRect();
+    if (opts.path.isEmpty() && !opts.clipboard && !opts.data) {
+        fail("one of path, clipboard or data is required");
+        return;
     }
 
-    const QSharedPointer<const QQuickItemGrabResult> grabResult = target->grabToImage();
-
-    QObject::connect(grabResult.data(), &QQuickItemGrabResult::ready, this,
-        [grabResult, scaledRect, path, onSaved, onFailed, this]() {
-            const auto future = QtConcurrent::run([=]() {
-                QImage image = grabResult->image();
-
-                if (scaledRect.isValid()) {
-                    image = image.copy(scaledRect);
-                }
+    if (opts.scale <= 0.0) {
+        fail(QString("scale %1 must be positive").arg(opts.scale));
+        return;
+    }
 
-                const QString file = path.toLocalFile();
-                const QString parent = QFileInfo(file).absolutePath();
-                return QDir().mkpath(parent) && image.save(file);
-            });
+    auto* engine = qmlEngine(this);
+    save(target, opts, [=](const SaveResult& result) {
+        if (!result.error.isEmpty()) {
+            fail("failed to save - " + result.error);
+            return;
+        }
 
-            auto* watcher = new QFutureWatcher<bool>(this);
-            auto* engine = qmlEngine(this);
-
-            QObject::connect(watcher, &QFutureWatcher<bool>::finished, this, [=]() {
-                if (watcher->result()) {
-                    if (onSaved.isCallable()) {
-                        onSaved.call(
-                            { QJSValue(path.toLocalFile()), engine->toScriptValue(QVariant::fromValue(path)) });
-                    }
-                } else {
-                    qWarning() << "CUtils::saveItem: failed to save" << path;
-                    if (onFailed.isCallable()) {
-                        onFailed.call({ engine->toScriptValue(QVariant::fromValue(path)) });
-                    }
-                }
-                watcher->deleteLater();
-            });
-            watcher->setFuture(future);
-        });
+        if (onSaved.isCallable()) {
+            const QVariantMap map{
+                { "path", opts.path.isLocalFile() ? opts.path.toLocalFile() : QString() },
+                { "url", opts.path },
+                { "data", opts.data ? QVariant(result.data) : QVariant() },
+            };
+            onSaved.call({ engine->toScriptValue(map) });
+        }
+    });
 }
 
 bool CUtils::copyFile(const QUrl& source, const QUrl& target, bool overwrite) const {
@@ -116,6 +152,168 @@ bool CUtils::deleteFile(const QUrl& path) const {
     return QFile::remove(path.toLocalFile());
 }
 
+void CUtils::save(
+    QQuickItem* target, const SaveOptions& options, const std::function<void(const SaveResult&)>& callback) {
+    if (!target) {
+        callback({ QByteArray(), "a target is required" });
+        return;
+    }
+
+    if (!target->window()) {
+        callback({ QByteArray(), "unable to save a target without a window" });
+        return;
+    }
+
+    SaveOptions resolved = options;
+    if (resolved.format.isEmpty()) {
+        const QString suffix = QFileInfo(options.path.path()).suffix();
+        resolved.format = suffix.isEmpty() ? "png" : suffix.toLatin1();
+    }
+    resolved.format = resolved.format.toLower();
+
+    const qreal dpr = target->window()->devicePixelRatio();
+
+    // Regions are rendered on their own through a layer restricted to them and grabbed at their final size, rather
+    // than rendering and reading back the whole target only to crop it
+    QQuickItem* source = target;
+    if (resolved.rect.isValid()) {
+        const QSize textureSize =
+            (QSizeF(resolved.rect.size()) * dpr * resolved.scale).toSize().expandedTo(QSize(1, 1));
+        if (auto* layer = createRegionLayer(target, resolved.rect, textureSize)) {
+            source = layer;
+            resolved.rect = QRect();
+        }
+    }
+    const QSizeF itemSize = source->size();
+
+    // The default grab is already at device pixels, only a custom scale or a region needs its own target size
+    const QSharedPointer<const QQuickItemGrabResult> grabResult =
+        qFuzzyCompare(resolved.scale, 1.0) && source == target
+            ? source->grabToImage()
+            : source->grabToImage((itemSize * dpr * resolved.scale).toSize().expandedTo(QSize(1, 1)));
+    if (!grabResult) {
+        if (source != target) {
+            source->deleteLater();
+        }
+        callback({ QByteArray(), "unable to grab target" });
+        return;
+    }
+
+    QObject::connect(grabResult.data(), &QQuickItemGrabResult::ready, this,
+        [grabResult, source, target, itemSize, dpr, resolved, callback, this]() {
+            if (source != target) {
+                source->deleteLater();
+            }
+
+            auto* watcher = new QFutureWatcher<SaveResult>(this);
+
+            QObject::connect(watcher, &QFutureWatcher<SaveResult>::finished, this, [watcher, resolved, callback]() {
+                const SaveResult result = watcher->result();
+
+                if (resolved.clipboard && result.error.isEmpty()) {
+                    // Already encoded, so pasting doesn't encode again like QClipboard::setImage would
+                    auto* mimeData = new QMimeData();
+                    const auto mimeType = QMimeDatabase().mimeTypeForFile(
+                        "image." + QString::fromLatin1(resolved.format), QMimeDatabase::MatchExtension);
+                    mimeData->setData(mimeType.name(), result.data);
+                    QGuiApplication::clipboard()->setMimeData(mimeData);
+                }
+
+                callback(result);
+                watcher->deleteLater();
+            });
+
+            watcher->setFuture(QtConcurrent::run(&CUtils::encode, grabResult->image(), itemSize, dpr, resolved));
+        });
+}
+
+QQuickItem* CUtils::createRegionLayer(QQuickItem* target, const QRect& rect, const QSize& textureSize) {
+    auto* engine = qmlEngine(this);
+    if (!engine) {
+        return nullptr;
+    }
+
+    // Stacked just below target and showing the same pixels in the same place, so it never visibly changes anything.
+    // The window's content item has nowhere to put a sibling, a layer inside its own source would capture itself
+    QQuickItem* parent = target->parentItem() ? target->parentItem() : target->window()->contentItem();
+    if (parent == target) {
+        return nullptr;
+    }
+    const QPointF pos = target->mapToItem(parent, rect.topLeft());
+
+    if (!m_regionLayer) {
+        m_regionLayer = new QQmlComponent(engine, this);
+        m_regionLayer->setData("import QtQuick\nShaderEffectSource { live: false; hideSource: false }", QUrl());
+    }
+
+    auto* layer = qobject_cast<QQuickItem*>(m_regionLayer->createWithInitialProperties({
+        { "sourceItem", QVariant::fromValue(target) },
+        { "sourceRect", QRectF(rect) },
+        { "textureSize", textureSize },
+        { "x", pos.x() },
+        { "y", pos.y() },
+        { "z", target->z() - 1.0 },
+        { "width", rect.width() },
+        { "height", rect.height() },
+    }));
+
+    if (!layer) {
+        qWarning() << "CUtils::createRegionLayer: unable to create layer, grabbing the whole target -"
+                   << m_regionLayer->errorString();
+        return nullptr;
+    }
+
+    layer->setParentItem(parent);
+    return layer;
+}
+
+CUtils::SaveResult CUtils::encode(const QImage& grab, const QSizeF& itemSize, qreal dpr, const SaveOptions& options) {
+    QImage image = grab;
+    if (image.isNull()) {
+        return { QByteArray(), "grab result is empty" };
+    }
+
+    // Map by the grab's actual size, Qt may round or apply the device pixel ratio differently to the target size
+    const qreal factor = itemSize.width() > 0.0 ? image.width() / itemSize.width() : dpr;
+
+    if (options.rect.isValid()) {
+        image = image.copy(QRectF(options.rect.left() * factor, options.rect.top() * factor,
+            options.rect.width() * factor, options.rect.height() * factor)
+                .toRect());
+    }
+
+    const qreal wanted = dpr * options.scale;
+    if (!qFuzzyCompare(factor, wanted)) {
+        image = image.scaled((QSizeF(image.size()) * (wanted / factor)).toSize().expandedTo(QSize(1, 1)),
+            Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+
+    QImageWriter writer(&buffer, options.format);
+    writer.setQuality(options.quality < 0 && options.format == "png" ? FAST_PNG_QUALITY : options.quality);
+    if (!writer.write(image)) {
+        return { QByteArray(), writer.errorString() };
+    }
+
+    if (options.path.isLocalFile()) {
+        const QString file = options.path.toLocalFile();
+        if (!QDir().mkpath(QFileInfo(file).absolutePath())) {
+            return { QByteArray(), "unable to create parent dir of " + file };
+        }
+
+        // Written in one go through a temporary file, so readers such as swappy never see a partial image
+        QSaveFile out(file);
+        if (!out.open(QIODevice::WriteOnly) || out.write(data) != data.size() || !out.commit()) {
+            return { QByteArray(), out.errorString() };
+        }
+    }
+
+    return { data, QString() };
+}
+
 QString CUtils::toLocalFile(const QUrl& url) const {
     if (!url.isLocalFile()) {
         qWarning() << "CUtils::toLocalFile: given url is not a local file" << url;
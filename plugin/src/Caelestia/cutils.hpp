@@ -1,9 +1,12 @@
 #pragma once
 
 #include <QtQuick/qquickitem.h>
+#include <functional>
 #include <qobject.h>
 #include <qqmlintegration.h>
 
+class QQmlComponent;
+
 namespace caelestia {
 
 class CUtils : public QObject {
@@ -21,9 +24,41 @@ public:
     Q_INVOKABLE void saveItem(QQuickItem* target, const QUrl& path, const QRect& rect, QJSValue onSaved, QJSValue onFailed);
     // clang-format on
 
+    // Grabs target and encodes it off the GUI thread. All options are optional:
+    //   path: url to save to, rect: region in item coordinates, scale: factor on top of the device pixel ratio,
+    //   format: e.g. "png" or "jpg" (defaults to the path's suffix, else png), quality: 0-100 (PNG defaults to a
+    //   fast compression level), clipboard: copy the encoded image, data: pass the encoded bytes to onSaved.
+    // onSaved receives { path, url, data }, onFailed an error message
+    Q_INVOKABLE void saveItemWith(
+        QQuickItem* target, const QVariantMap& options, QJSValue onSaved = QJSValue(), QJSValue onFailed = QJSValue());
+
     Q_INVOKABLE bool copyFile(const QUrl& source, const QUrl& target, bool overwrite = true) const;
     Q_INVOKABLE bool deleteFile(const QUrl& path) const;
     Q_INVOKABLE QString toLocalFile(const QUrl& url) const;
+
+private:
+    struct SaveOptions {
+        QUrl path;
+        QRect rect;
+        qreal scale = 1.0;
+        QByteArray format;
+        int quality = -1;
+        bool clipboard = false;
+        bool data = false;
+    };
+
+    struct SaveResult {
+        QByteArray data;
+        QString error;
+    };
+
+    // Compiled on first use, every region save creates its layer from it
+    QQmlComponent* m_regionLayer = nullptr;
+
+    void save(QQuickItem* target, const SaveOptions& options, const std::function<void(const SaveResult&)>& callback);
+    [[nodiscard]] QQuickItem* createRegionLayer(QQuickItem* target, const QRect& rect, const QSize& textureSize);
+    [[nodiscard]] static SaveResult encode(
+        const QImage& grab, const QSizeF& itemSize, qreal dpr, const SaveOptions& options);
 };
 
 } // namespace caelestia
@@ -0,0 +1,352 @@
+#include "hct.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numbers>
+
+namespace caelestia::colour {
+
+namespace {
+
+using Vec3 = std::array<double, 3>;
+
+constexpr Vec3 WHITE_POINT = { 95.047, 100.0, 108.883 }; // D65
+constexpr double LAB_E = 216.0 / 24389.0;
+constexpr double LAB_KAPPA = 24389.0 / 27.0;
+
+struct ViewingConditions {
+    Vec3 rgbD;
+    double n;
+    double aw;
+    double nbb;
+    double ncb;
+    double c;
+    double nc;
+    double fl;
+    double z;
+};
+
+double sanitiseDegrees(double degrees) {
+    degrees = std::fmod(degrees, 360.0);
+    return degrees < 0.0 ? degrees + 360.0 : degrees;
+}
+
+double linearise(int channel) {
+    const double normalised = channel / 255.0;
+    return 100.0 * (normalised <= 0.040449936 ? normalised / 12.92 : std::pow((normalised + 0.055) / 1.055, 2.4));
+}
+
+int delinearise(double channel) {
+    const double normalised = channel / 100.0;
+    const double delinearised =
+        normalised <= 0.0031308 ? normalised * 12.92 : 1.055 * std::pow(normalised, 1.0 / 2.4) - 0.055;
+    return std::clamp(static_cast<int>(std::lround(delinearised * 255.0)), 0, 255);
+}
+
+double labF(double t) {
+    return t > LAB_E ? std::cbrt(t) : (LAB_KAPPA * t + 16.0) / 116.0;
+}
+
+double labInvF(double ft) {
+    const double ft3 = ft * ft * ft;
+    return ft3 > LAB_E ? ft3 : (116.0 * ft - 16.0) / LAB_KAPPA;
+}
+
+double lstarFromY(double y) {
+    return 116.0 * labF(y / 100.0) - 16.0;
+}
+
+double yFromLstar(double lstar) {
+    return 100.0 * labInvF((lstar + 16.0) / 116.0);
+}
+
+Vec3 xyzFromRgb(QRgb rgb) {
+    const double r = linearise(qRed(rgb));
+    const double g = linearise(qGreen(rgb));
+    const double b = linearise(qBlue(rgb));
+    return { 0.41233895 * r + 0.35762064 * g + 0.18051042 * b, 0.2126 * r + 0.7152 * g + 0.0722 * b,
+        0.01932141 * r + 0.11916382 * g + 0.95034478 * b };
+}
+
+Vec3 linearRgbFromXyz(const Vec3& xyz) {
+    const auto& [x, y, z] = xyz;
+    return { 3.2413774792388685 * x - 1.5376652402851851 * y - 0.49885366846268053 * z,
+        -0.9691452513005321 * x + 1.8758853451067872 * y + 0.04156585616912061 * z,
+        0.05562093689691305 * x - 0.20395524564742123 * y + 1.0571799111220335 * z };
+}
+
+QRgb rgbFromLinearRgb(const Vec3& linear) {
+    return qRgb(delinearise(linear[0]), delinearise(linear[1]), delinearise(linear[2]));
+}
+
+bool isInGamut(const Vec3& linear) {
+    constexpr double epsilon = 0.01;
+    return std::all_of(linear.cbegin(), linear.cend(), [](double channel) {
+        return channel >= -epsilon && channel <= 100.0 + epsilon;
+    });
+}
+
+ViewingConditions makeViewingConditions() {
+    // Default Material viewing conditions: D65, average surround, mid grey background
+    const double adaptingLuminance = 200.0 / std::numbers::pi * yFromLstar(50.0) / 100.0;
+    const double surround = 2.0;
+
+    const auto& [wx, wy, wz] = WHITE_POINT;
+    const Vec3 rgbW = { wx * 0.401288 + wy * 0.650173 + wz * -0.051461,
+        wx * -0.250268 + wy * 1.204414 + wz * 0.045854, wx * -0.002079 + wy * 0.048952 + wz * 0.953127 };
+
+    const double f = 0.8 + surround / 10.0;
+    const double c = f >= 0.9 ? std::lerp(0.59, 0.69, (f - 0.9) * 10.0) : std::lerp(0.525, 0.59, (f - 0.8) * 10.0);
+    const double d = std::clamp(f * (1.0 - (1.0 / 3.6) * std::exp((-adaptingLuminance - 42.0) / 92.0)), 0.0, 1.0);
+
+    Vec3 rgbD;
+    for (std::size_t i = 0; i < 3; ++i) {
+        rgbD[i] = d * (100.0 / rgbW[i]) + 1.0 - d;
+    }
+
+    const double k = 1.0 / (5.0 * adaptingLuminance + 1.0);
+    const double k4 = k * k * k * k;
+    const double k4F = 1.0 - k4;
+    const double fl = k4 * adaptingLuminance + 0.1 * k4F * k4F * std::cbrt(5.0 * adaptingLuminance);
+    const double n = yFromLstar(50.0) / wy;
+    const double z = 1.48 + std::sqrt(n);
+    const double nbb = 0.725 / std::pow(n, 0.2);
+
+    Vec3 rgbA;
+    for (std::size_t i = 0; i < 3; ++i) {
+        const double factor = std::pow(fl * rgbD[i] * rgbW[i] / 100.0, 0.42);
+        rgbA[i] = 400.0 * factor / (factor + 27.13);
+    }
+    const double aw = (2.0 * rgbA[0] + rgbA[1] + 0.05 * rgbA[2]) * nbb;
+
+    return { rgbD, n, aw, nbb, nbb, c, f, fl, z };
+}
+
+const ViewingConditions& viewingConditions() {
+    static const ViewingConditions conditions = makeViewingConditions();
+    return conditions;
+}
+
+Vec3 xyzFromJch(double j, double chroma, double hue) {
+    const auto& vc = viewingConditions();
+
+    const double alpha = chroma <= 0.0 || j <= 0.0 ? 0.0 : chroma / std::sqrt(j / 100.0);
+    const double t = std::pow(alpha / std::pow(1.64 - std::pow(0.29, vc.n), 0.73), 1.0 / 0.9);
+    const double hueRadians = hue * std::numbers::pi / 180.0;
+
+    const double eHue = 0.25 * (std::cos(hueRadians + 2.0) + 3.8);
+    const double ac = vc.aw * std::pow(j / 100.0, 1.0 / vc.c / vc.z);
+    const double p1 = eHue * (50000.0 / 13.0) * vc.nc * vc.ncb;
+    const double p2 = ac / vc.nbb;
+
+    const double hueSin = std::sin(hueRadians);
+    const double hueCos = std::cos(hueRadians);
+
+    const double gamma = 23.0 * (p2 + 0.305) * t / (23.0 * p1 + 11.0 * t * hueCos + 108.0 * t * hueSin);
+    const double a = gamma * hueCos;
+    const double b = gamma * hueSin;
+
+    const Vec3 rgbA = { (460.0 * p2 + 451.0 * a + 288.0 * b) / 1403.0, (460.0 * p2 - 891.0 * a - 261.0 * b) / 1403.0,
+        (460.0 * p2 - 220.0 * a - 6300.0 * b) / 1403.0 };
+
+    Vec3 rgbF;
+    for (std::size_t i = 0; i < 3; ++i) {
+        const double base = std::max(0.0, 27.13 * std::abs(rgbA[i]) / (400.0 - std::abs(rgbA[i])));
+        const double adapted = std::copysign(100.0 / vc.fl * std::pow(base, 1.0 / 0.42), rgbA[i]);
+        rgbF[i] = adapted / vc.rgbD[i];
+    }
+
+    const auto& [rF, gF, bF] = rgbF;
+    return { 1.86206786 * rF - 1.01125463 * gF + 0.14918677 * bF, 0.38752654 * rF + 0.62144744 * gF - 0.00897398 * bF,
+        -0.01584150 * rF - 0.03412294 * gF + 1.04996444 * bF };
+}
+
+Vec3 linearRgbForY(double hue, double chroma, double y) {
+    // Y grows with J at a fixed hue and chroma, so binary search J for the target tone
+    double low = 0.0;
+    double high = 100.0;
+    Vec3 xyz{};
+    for (int i = 0; i < 24; ++i) {
+        const double mid = (low + high) / 2.0;
+        xyz = xyzFromJch(mid, chroma, hue);
+        if (xyz[1] < y) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return linearRgbFromXyz(xyz);
+}
+
+} // namespace
+
+Lab Lab::fromRgb(QRgb rgb) {
+    const Vec3 xyz = xyzFromRgb(rgb);
+    const double fx = labF(xyz[0] / WHITE_POINT[0]);
+    const double fy = labF(xyz[1] / WHITE_POINT[1]);
+    const double fz = labF(xyz[2] / WHITE_POINT[2]);
+    return { 116.0 * fy - 16.0, 500.0 * (fx - fy), 200.0 * (fy - fz) };
+}
+
+QRgb Lab::toRgb() const {
+    const double fy = (l + 16.0) / 116.0;
+    const double fx = a / 500.0 + fy;
+    const double fz = fy - b / 200.0;
+    const Vec3 xyz = { labInvF(fx) * WHITE_POINT[0], labInvF(fy) * WHITE_POINT[1], labInvF(fz) * WHITE_POINT[2] };
+    return rgbFromLinearRgb(linearRgbFromXyz(xyz));
+}
+
+Hct Hct::fromRgb(QRgb rgb) {
+    const auto& vc = viewingConditions();
+    const Vec3 xyz = xyzFromRgb(rgb);
+    const auto& [x, y, z] = xyz;
+
+    const Vec3 rgbC = { 0.401288 * x + 0.650173 * y - 0.051461 * z, -0.250268 * x + 1.204414 * y + 0.045854 * z,
+        -0.002079 * x + 0.048952 * y + 0.953127 * z };
+
+    Vec3 rgbA;
+    for (std::size_t i = 0; i < 3; ++i) {
+        const double d = vc.rgbD[i] * rgbC[i];
+        const double factor = std::pow(vc.fl * std::abs(d) / 100.0, 0.42);
+        rgbA[i] = std::copysign(400.0 * factor / (factor + 27.13), d);
+    }
+    const auto& [rA, gA, bA] = rgbA;
+
+    const double a = (11.0 * rA + -12.0 * gA + bA) / 11.0;
+    const double b = (rA + gA - 2.0 * bA) / 9.0;
+    const double u = (20.0 * rA + 20.0 * gA + 21.0 * bA) / 20.0;
+    const double p2 = (40.0 * rA + 20.0 * gA + bA) / 20.0;
+
+    const double hue = sanitiseDegrees(std::atan2(b, a) * 180.0 / std::numbers::pi);
+    const double ac = p2 * vc.nbb;
+    const double j = 100.0 * std::pow(ac / vc.aw, vc.c * vc.z);
+
+    const double huePrime = hue < 20.14 ? hue + 360.0 : hue;
+    const double eHue = 0.25 * (std::cos(huePrime * std::numbers::pi / 180.0 + 2.0) + 3.8);
+    const double p1 = 50000.0 / 13.0 * eHue * vc.nc * vc.ncb;
+    const double t = p1 * std::hypot(a, b) / (u + 0.305);
+    const double alpha = std::pow(1.64 - std::pow(0.29, vc.n), 0.73) * std::pow(t, 0.9);
+    const double chroma = alpha * std::sqrt(j / 100.0);
+
+    return { hue, chroma, lstarFromY(y) };
+}
+
+QRgb Hct::toRgb(double hue, double chroma, double tone) {
+    const double y = yFromLstar(tone);
+    const Vec3 grey = { y, y, y };
+
+    if (chroma < 0.0001 || tone < 0.0001 || tone > 99.9999) {
+        return rgbFromLinearRgb(grey);
+    }
+
+    hue = sanitiseDegrees(hue);
+
+    const Vec3 exact = linearRgbForY(hue, chroma, y);
+    if (isInGamut(exact)) {
+        return rgbFromLinearRgb(exact);
+    }
+
+    // Highest chroma that still fits in sRGB at this hue and tone
+    double low = 0.0;
+    double high = chroma;
+    Vec3 best = grey;
+    for (int i = 0; i < 16; ++i) {
+        const double mid = (low + high) / 2.0;
+        const Vec3 candidate = linearRgbForY(hue, mid, y);
+        if (isInGamut(candidate)) {
+            best = candidate;
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return rgbFromLinearRgb(best);
+}
+
+TonalPalette::TonalPalette(double hue, double chroma)
+    : m_hue(hue)
+    , m_chroma(chroma) {}
+
+QRgb TonalPalette::tone(double tone) const {
+    return Hct::toRgb(m_hue, m_chroma, tone);
+}
+
+QRgb TonalPalette::keyColour() const {
+    return Hct::toRgb(m_hue, m_chroma, 50.0);
+}
+
+Scheme tonalSpotScheme(QRgb seed, bool light) {
+    const Hct source = Hct::fromRgb(seed);
+
+    const TonalPalette primary(source.hue, 36.0);
+    const TonalPalette secondary(source.hue, 16.0);
+    const TonalPalette tertiary(sanitiseDegrees(source.hue + 60.0), 24.0);
+    const TonalPalette neutral(source.hue, 6.0);
+    const TonalPalette neutralVariant(source.hue, 8.0);
+    const TonalPalette error(25.0, 84.0);
+
+    const auto tone = [light](double lightTone, double darkTone) {
+        return light ? lightTone : darkTone;
+    };
+
+    return {
+        { "primary_paletteKeyColor", primary.keyColour() },
+        { "secondary_paletteKeyColor", secondary.keyColour() },
+        { "tertiary_paletteKeyColor", tertiary.keyColour() },
+        { "neutral_paletteKeyColor", neutral.keyColour() },
+        { "neutral_variant_paletteKeyColor", neutralVariant.keyColour() },
+        { "background", neutral.tone(tone(98, 6)) },
+        { "onBackground", neutral.tone(tone(10, 90)) },
+        { "surface", neutral.tone(tone(98, 6)) },
+        { "surfaceDim", neutral.tone(tone(87, 6)) },
+        { "surfaceBright", neutral.tone(tone(98, 24)) },
+        { "surfaceContainerLowest", neutral.tone(tone(100, 4)) },
+        { "surfaceContainerLow", neutral.tone(tone(96, 10)) },
+        { "surfaceContainer", neutral.tone(tone(94, 12)) },
+        { "surfaceContainerHigh", neutral.tone(tone(92, 17)) },
+        { "surfaceContainerHighest", neutral.tone(tone(90, 22)) },
+        { "onSurface", neutral.tone(tone(10, 90)) },
+        { "surfaceVariant", neutralVariant.tone(tone(90, 30)) },
+        { "onSurfaceVariant", neutralVariant.tone(tone(30, 80)) },
+        { "inverseSurface", neutral.tone(tone(20, 90)) },
+        { "inverseOnSurface", neutral.tone(tone(95, 20)) },
+        { "outline", neutralVariant.tone(tone(50, 60)) },
+        { "outlineVariant", neutralVariant.tone(tone(80, 30)) },
+        { "shadow", neutral.tone(0) },
+        { "scrim", neutral.tone(0) },
+        { "surfaceTint", primary.tone(tone(40, 80)) },
+        { "primary", primary.tone(tone(40, 80)) },
+        { "onPrimary", primary.tone(tone(100, 20)) },
+        { "primaryContainer", primary.tone(tone(90, 30)) },
+        { "onPrimaryContainer", primary.tone(tone(10, 90)) },
+        { "inversePrimary", primary.tone(tone(80, 40)) },
+        { "secondary", secondary.tone(tone(40, 80)) },
+        { "onSecondary", secondary.tone(tone(100, 20)) },
+        { "secondaryContainer", secondary.tone(tone(90, 30)) },
+        { "onSecondaryContainer", secondary.tone(tone(10, 90)) },
+        { "tertiary", tertiary.tone(tone(40, 80)) },
+        { "onTertiary", tertiary.tone(tone(100, 20)) },
+        { "tertiaryContainer", tertiary.tone(tone(90, 30)) },
+        { "onTertiaryContainer", tertiary.tone(tone(10, 90)) },
+        { "error", error.tone(tone(40, 80)) },
+        { "onError", error.tone(tone(100, 20)) },
+        { "errorContainer", error.tone(tone(90, 30)) },
+        { "onErrorContainer", error.tone(tone(10, 90)) },
+        { "primaryFixed", primary.tone(90) },
+        { "primaryFixedDim", primary.tone(80) },
+        { "onPrimaryFixed", primary.tone(10) },
+        { "onPrimaryFixedVariant", primary.tone(30) },
+        { "secondaryFixed", secondary.tone(90) },
+        { "secondaryFixedDim", secondary.tone(80) },
+        { "onSecondaryFixed", secondary.tone(10) },
+        { "onSecondaryFixedVariant", secondary.tone(30) },
+        { "tertiaryFixed", tertiary.tone(90) },
+        { "tertiaryFixedDim", tertiary.tone(80) },
+        { "onTertiaryFixed", tertiary.tone(10) },
+        { "onTertiaryFixedVariant", tertiary.tone(30) },
+    };
+}
+
+} // namespace caelestia::colour
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <qrgb.h>
+#include <utility>
+#include <vector>
+
+namespace caelestia::colour {
+
+struct Lab {
+    double l;
+    double a;
+    double b;
+
+    [[nodiscard]] static Lab fromRgb(QRgb rgb);
+    [[nodiscard]] QRgb toRgb() const;
+};
+
+// Hue and chroma from CAM16 under default viewing conditions, tone is CIE L*
+struct Hct {
+    double hue;
+    double chroma;
+    double tone;
+
+    [[nodiscard]] static Hct fromRgb(QRgb rgb);
+    // Closest in gamut colour, chroma is reduced until the hue and tone can be represented in sRGB
+    [[nodiscard]] static QRgb toRgb(double hue, double chroma, double tone);
+};
+
+class TonalPalette {
+public:
+    explicit TonalPalette(double hue, double chroma);
+
+    [[nodiscard]] QRgb tone(double tone) const;
+    [[nodiscard]] QRgb keyColour() const;
+
+private:
+    double m_hue;
+    double m_chroma;
+};
+
+using Scheme = std::vector<std::pair<const char*, QRgb>>;
+
+// Material "tonal spot" scheme, named like the colours in the caelestia scheme json (without the m3 prefix)
+[[nodiscard]] Scheme tonalSpotScheme(QRgb seed, bool light);
+
+} // namespace caelestia::colour
@@ -1,38 +1,170 @@
 #include "imageanalyser.hpp"
 
+#include "Internal/cachingimagemanager.hpp"
+#include "Internal/imagecache.hpp"
+#include "hct.hpp"
+#include "quantiser.hpp"
 #include <QtConcurrent/qtconcurrentrun.h>
 #include <QtQuick/qquickitemgrabresult.h>
 #include <qfuturewatcher.h>
 #include <qimage.h>
+#include <qimagereader.h>
+#include <qmath.h>
 #include <qquickwindow.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace caelestia {
 
+namespace {
+
+constexpr std::size_t HISTOGRAM_SIZE = 1 << 15; // 5 bits per channel fits exactly
+constexpr int QUANTISE_COLOURS = 128;
+constexpr int ANIMATION_SAMPLES = 4;
+
+using LuminanceTable = std::array<float, 256>;
+
+constexpr LuminanceTable luminanceTable(double weight) {
+    LuminanceTable table{};
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        const double value = static_cast<double>(i) / 255.0;
+        table[i] = static_cast<float>(weight * value * value);
+    }
+    return table;
+}
+
+// Weighted squared channels of the perceived brightness sqrt(0.299 r^2 + 0.587 g^2 + 0.114 b^2)
+constexpr LuminanceTable RED_LUMINANCE = luminanceTable(0.299);
+constexpr LuminanceTable GREEN_LUMINANCE = luminanceTable(0.587);
+constexpr LuminanceTable BLUE_LUMINANCE = luminanceTable(0.114);
+
+float sumSqrt(const float* values, std::size_t count) {
+    float sum = 0.0f;
+    std::size_t i = 0;
+
+#ifdef __SSE2__
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        acc = _mm_add_ps(acc, _mm_sqrt_ps(_mm_loadu_ps(values + i)));
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, acc);
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(__aarch64__)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= count; i += 4) {
+        acc = vaddq_f32(acc, vsqrtq_f32(vld1q_f32(values + i)));
+    }
+    sum = vaddvq_f32(acc);
+#endif
+
+    for (; i < count; ++i) {
+        sum += std::sqrt(values[i]);
+    }
+
+    return sum;
+}
+
+// Maps a fractional region onto an image of the given size, or the whole image if the region is empty
+QRect pixelRegion(const QRectF& region, const QSize& size) {
+    const QRect bounds(QPoint(0, 0), size);
+    if (region.isEmpty()) {
+        return bounds;
+    }
+
+    return QRectF(region.x() * size.width(), region.y() * size.height(), region.width() * size.width(),
+        region.height() * size.height())
+        .toAlignedRect()
+        .intersected(bounds);
+}
+
+// Reads the frames of an animation in order and stacks evenly spaced samples of them into one image
+QImage readFrames(QImageReader& reader, int frameCount, int samples) {
+    samples = qMin(samples, frameCount);
+
+    QList<QImage> frames;
+    for (int i = 0; i < frameCount && frames.size() < samples; ++i) {
+        // Frames can depend on the previous ones, so they have to be read in order
+        const QImage frame = reader.read();
+        if (frame.isNull()) {
+            break;
+        }
+
+        // Sample n is the frame in the middle of the nth of samples equal spans
+        const qsizetype n = frames.size();
+        if (i == (2 * n + 1) * frameCount / (2 * samples)) {
+            frames << frame.convertToFormat(QImage::Format_ARGB32);
+        }
+    }
+
+    if (frames.isEmpty()) {
+        return QImage();
+    }
+
+    const QSize frameSize = frames.first().size();
+    QImage stacked(frameSize.width(), frameSize.height() * static_cast<int>(frames.size()), QImage::Format_ARGB32);
+    for (qsizetype i = 0; i < frames.size(); ++i) {
+        QImage frame = frames.at(i);
+        if (frame.size() != frameSize) {
+            frame = frame.scaled(frameSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        }
+
+        const int top = frameSize.height() * static_cast<int>(i);
+        for (int y = 0; y < frameSize.height(); ++y) {
+            const auto* line = reinterpret_cast<const QRgb*>(frame.constScanLine(y));
+            std::copy_n(line, frameSize.width(), reinterpret_cast<QRgb*>(stacked.scanLine(top + y)));
+        }
+    }
+    return stacked;
+}
+
+} // namespace
+
 ImageAnalyser::ImageAnalyser(QObject* parent)
     : QObject(parent)
-    , m_futureWatcher(new QFutureWatcher<AnalyseResult>(this))
+    , m_futureWatcher(new QFutureWatcher<AnalysisResult>(this))
     , m_source("")
     , m_sourceItem(nullptr)
     , m_rescaleSize(128)
     , m_dominantColour(0, 0, 0)
-    , m_luminance(0) {
-    QObject::connect(m_futureWatcher, &QFutureWatcher<AnalyseResult>::finished, this, [this]() {
+    , m_luminance(0)
+    , m_paletteSize(0)
+    , m_schemeLight(false) {
+    QObject::connect(m_futureWatcher, &QFutureWatcher<AnalysisResult>::finished, this, [this]() {
         if (!m_futureWatcher->future().isResultReadyAt(0)) {
             return;
         }
 
         const auto result = m_futureWatcher->result();
-        if (m_dominantColour != result.first) {
-            m_dominantColour = result.first;
-            emit dominantColourChanged();
-        }
-        if (!qFuzzyCompare(m_luminance + 1.0, result.second + 1.0)) {
-            m_luminance = result.second;
-            emit luminanceChanged();
-        }
+        AnalysisCache::instance().insert(m_resultKey, result);
+        applyResult(result);
     });
 }
 
+void ImageAnalyser::applyResult(const AnalysisResult& result) {
+    if (m_dominantColour != result.dominantColour) {
+        m_dominantColour = result.dominantColour;
+        emit dominantColourChanged();
+    }
+    if (!qFuzzyCompare(m_luminance + 1.0, result.luminance + 1.0)) {
+        m_luminance = result.luminance;
+        emit luminanceChanged();
+    }
+    if (m_palette != result.palette) {
+        m_palette = result.palette;
+        emit paletteChanged();
+        updateScheme();
+    }
+}
+
 QString ImageAnalyser::source() const {
     return m_source;
 }
@@ -88,6 +220,36 @@ void ImageAnalyser::setRescaleSize(int rescaleSize) {
     requestUpdate();
 }
 
+QRectF ImageAnalyser::sourceRect() const {
+    return m_sourceRect;
+}
+
+void ImageAnalyser::setSourceRect(const QRectF& sourceRect) {
+    if (m_sourceRect == sourceRect) {
+        return;
+    }
+
+    m_sourceRect = sourceRect;
+    emit sourceRectChanged();
+
+    requestUpdate();
+}
+
+QUrl ImageAnalyser::thumbnailDir() const {
+    return m_thumbnailDir;
+}
+
+void ImageAnalyser::setThumbnailDir(const QUrl& thumbnailDir) {
+    if (m_thumbnailDir == thumbnailDir) {
+        return;
+    }
+
+    m_thumbnailDir = thumbnailDir;
+    emit thumbnailDirChanged();
+
+    requestUpdate();
+}
+
 QColor ImageAnalyser::dominantColour() const {
     return m_dominantColour;
 }
@@ -96,6 +258,44 @@ qreal ImageAnalyser::luminance() const {
     return m_luminance;
 }
 
+int ImageAnalyser::paletteSize() const {
+    return m_paletteSize;
+}
+
+void ImageAnalyser::setPaletteSize(int paletteSize) {
+    if (m_paletteSize == paletteSize) {
+        return;
+    }
+
+    m_paletteSize = paletteSize;
+    emit paletteSizeChanged();
+
+    requestUpdate();
+}
+
+QList<QColor> ImageAnalyser::palette() const {
+    return m_palette;
+}
+
+bool ImageAnalyser::schemeLight() const {
+    return m_schemeLight;
+}
+
+void ImageAnalyser::setSchemeLight(bool schemeLight) {
+    if (m_schemeLight == schemeLight) {
+        return;
+    }
+
+    m_schemeLight = schemeLight;
+    emit schemeLightChanged();
+
+    updateScheme();
+}
+
+QVariantMap ImageAnalyser::scheme() const {
+    return m_scheme;
+}
+
 void ImageAnalyser::requestUpdate() {
     if (m_source.isEmpty() && !m_sourceItem) {
         return;
@@ -132,29 +332,172 @@ void ImageAnalyser::update() {
         m_futureWatcher->cancel();
     }
 
+    m_resultKey.clear();
+
     if (m_sourceItem) {
-        const QSharedPointer<const QQuickItemGrabResult> grabResult = m_sourceItem->grabToImage();
-        QObject::connect(grabResult.data(), &QQuickItemGrabResult::ready, this, [grabResult, this]() {
-            m_futureWatcher->setFuture(QtConcurrent::run(&ImageAnalyser::analyse, grabResult->image(), m_rescaleSize));
-        });
+        grabSourceItem();
     } else {
-        m_futureWatcher->setFuture(QtConcurrent::run([=, this](QPromise<AnalyseResult>& promise) {
-            const QImage image(m_source);
-            analyse(promise, image, m_rescaleSize);
-        }));
+        analyseFile(m_source);
     }
 }
 
-void ImageAnalyser::analyse(QPromise<AnalyseResult>& promise, const QImage& image, int rescaleSize) {
+void ImageAnalyser::updateScheme() {
+    QVariantMap scheme;
+
+    // The highest scored colour seeds the scheme, like Material's dynamic colour
+    if (!m_palette.isEmpty()) {
+        for (const auto& [name, rgb] : colour::tonalSpotScheme(m_palette.first().rgb(), m_schemeLight)) {
+            scheme.insert(name, QColor(rgb));
+        }
+    }
+
+    if (m_scheme != scheme) {
+        m_scheme = scheme;
+        emit schemeChanged();
+    }
+}
+
+void ImageAnalyser::grabSourceItem() {
+    // Images showing a local file are analysed from the file instead, which skips the extra render and GPU
+    // readback and goes through the result cache. That includes CachingImages, whose provider serves a cache file.
+    // Regions are relative to the item, so those still need a grab
+    if (m_sourceRect.isEmpty()) {
+        const auto url = m_sourceItem->property("source").toUrl();
+        if (url.isLocalFile()) {
+            analyseFile(url.toLocalFile());
+            return;
+        }
+        if (const QString cache = internal::ImageCache::providerPath(url); !cache.isEmpty()) {
+            analyseFile(cache);
+            return;
+        }
+    }
+
+    const QSizeF itemSize = m_sourceItem->size();
+    if (itemSize.isEmpty()) {
+        return;
+    }
+
+    // Render only as many pixels as the analysis uses, so the region's longer side lands on rescaleSize
+    qreal scale = 1.0;
+    if (m_rescaleSize > 0) {
+        const QSizeF regionSize = m_sourceRect.isEmpty()
+                                      ? itemSize
+                                      : QSizeF(m_sourceRect.width() * itemSize.width(),
+                                            m_sourceRect.height() * itemSize.height());
+        scale = std::min(1.0, m_rescaleSize / std::max(regionSize.width(), regionSize.height()));
+    }
+    const QSize targetSize = (itemSize * scale).toSize().expandedTo(QSize(1, 1));
+
+    const QSharedPointer<const QQuickItemGrabResult> grabResult = m_sourceItem->grabToImage(targetSize);
+    if (!grabResult) {
+        return;
+    }
+
+    QObject::connect(grabResult.data(), &QQuickItemGrabResult::ready, this,
+        [grabResult, rescaleSize = m_rescaleSize, paletteSize = m_paletteSize, region = m_sourceRect, this]() {
+            m_futureWatcher->setFuture(QtConcurrent::run(
+                &ImageAnalyser::analyse, grabResult->image(), rescaleSize, paletteSize, region));
+        });
+}
+
+void ImageAnalyser::analyseFile(const QString& path) {
+    m_resultKey = AnalysisCache::key(path, m_rescaleSize, m_paletteSize, m_sourceRect);
+
+    if (const auto cached = AnalysisCache::instance().find(m_resultKey)) {
+        // Detach from any in-flight analysis so it can't overwrite the cached result when it finishes
+        m_futureWatcher->setFuture(QFuture<AnalysisResult>());
+        applyResult(*cached);
+        return;
+    }
+
+    const int rescaleSize = m_rescaleSize;
+    const int paletteSize = m_paletteSize;
+    const QRectF region = m_sourceRect;
+    const QString thumbnailDir = m_thumbnailDir.toLocalFile();
+
+    m_futureWatcher->setFuture(QtConcurrent::run([=](QPromise<AnalysisResult>& promise) {
+        analyseSource(promise, path, rescaleSize, paletteSize, region, thumbnailDir);
+    }));
+}
+
+void ImageAnalyser::analyseSource(QPromise<AnalysisResult>& promise, const QString& path, int rescaleSize,
+    int paletteSize, const QRectF& region, const QString& thumbnailDir) {
+    if (promise.isCanceled()) {
+        return;
+    }
+
+    // The region is already applied while reading
+    analyse(promise, readSource(path, rescaleSize, region, thumbnailDir), rescaleSize, paletteSize, QRectF());
+}
+
+QImage ImageAnalyser::readSource(
+    const QString& path, int rescaleSize, const QRectF& region, const QString& thumbnailDir) {
+    QImageReader reader(path);
+
+    // Animations are analysed from a few frames spread over their length. GIFs always claim animation support, so
+    // the image count tells single frame ones apart (0 if unknown)
+    const int frames = reader.supportsAnimation() ? reader.imageCount() : 1;
+    const int samples = std::clamp(frames, 1, ANIMATION_SAMPLES);
+
+    // Pyramids only hold the first frame. Finding one means hashing the whole source, which only pays off for formats
+    // that can't scale while decoding (e.g. PNG), JPEG's DCT scaling is cheaper than that
+    if (!thumbnailDir.isEmpty() && rescaleSize > 0 && samples == 1 &&
+        !reader.supportsOption(QImageIOHandler::ScaledSize)) {
+        // The region has to cover rescaleSize after cropping, so the level must be that much larger
+        const qreal fraction = region.isEmpty() ? 1.0 : std::max(region.width(), region.height());
+        const QImage mip =
+            internal::CachingImageManager::findMipLevel(thumbnailDir, path, qCeil(rescaleSize / fraction));
+        if (!mip.isNull()) {
+            return region.isEmpty() ? mip : mip.copy(pixelRegion(region, mip.size()));
+        }
+    }
+
+    const QSize size = reader.size();
+
+    // Decode straight to the analysis size where the format supports it (e.g. JPEG DCT scaling), otherwise
+    // QImageReader scales with SmoothTransformation, which area averages when downscaling
+    if (size.isValid()) {
+        const QRect clip = pixelRegion(region, size);
+        if (!region.isEmpty()) {
+            reader.setClipRect(clip);
+        }
+
+        // Sampled frames are stacked vertically, so each only gets a slice of the analysis size
+        const QSize target(rescaleSize, std::max(1, rescaleSize / samples));
+        if (rescaleSize > 0 && (clip.width() > target.width() || clip.height() > target.height())) {
+            reader.setScaledSize(clip.size().scaled(target, Qt::KeepAspectRatio));
+        }
+    }
+
+    const QImage image = samples > 1 ? readFrames(reader, frames, samples) : reader.read();
+    if (image.isNull()) {
+        qWarning() << "ImageAnalyser::readSource: failed to read" << path << "-" << reader.errorString();
+        return image;
+    }
+
+    // Formats that can't report their size up front are cropped after the full decode
+    if (!size.isValid() && !region.isEmpty()) {
+        return image.copy(pixelRegion(region, image.size()));
+    }
+    return image;
+}
+
+void ImageAnalyser::analyse(QPromise<AnalysisResult>& promise, const QImage& image, int rescaleSize, int paletteSize,
+    const QRectF& region) {
     if (image.isNull()) {
         qWarning() << "ImageAnalyser::analyse: image is null";
         return;
     }
 
-    QImage img = image;
+    QImage img = region.isEmpty() ? image : image.copy(pixelRegion(region, image.size()));
+    if (img.isNull()) {
+        qWarning() << "ImageAnalyser::analyse: region" << region << "is outside the image";
+        return;
+    }
 
     if (rescaleSize > 0 && (img.width() > rescaleSize || img.height() > rescaleSize)) {
-        img = img.scaled(rescaleSize, rescaleSize, Qt::KeepAspectRatio, Qt::FastTransformation);
+        img = img.scaled(rescaleSize, rescaleSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
     }
 
     if (promise.isCanceled()) {
@@ -169,55 +512,58 @@ void ImageAnalyser::analyse(QPromise<AnalyseResult>& promise, const QImage& imag
         return;
     }
 
-    const uchar* data = img.bits();
     const int width = img.width();
     const int height = img.height();
-    const qsizetype bytesPerLine = img.bytesPerLine();
 
-    std::unordered_map<quint32, int> colours;
+    colour::ColourHistogram histogram(HISTOGRAM_SIZE, 0);
+    std::vector<float> lineLuminance(static_cast<std::size_t>(width));
     qreal totalLuminance = 0.0;
-    int count = 0;
+    qsizetype count = 0;
 
     for (int y = 0; y < height; ++y) {
-        const uchar* line = data + y * bytesPerLine;
-        for (int x = 0; x < width; ++x) {
-            if (promise.isCanceled()) {
-                return;
-            }
+        if (promise.isCanceled()) {
+            return;
+        }
 
-            const uchar* pixel = line + x * 4;
+        const auto* line = reinterpret_cast<const QRgb*>(img.constScanLine(y));
+        std::size_t opaque = 0;
 
-            if (pixel[3] == 0) {
+        for (int x = 0; x < width; ++x) {
+            const QRgb pixel = line[x];
+
+            if (qAlpha(pixel) == 0) {
                 continue;
             }
 
-            const quint32 mr = static_cast<quint32>(pixel[0] & 0xF8);
-            const quint32 mg = static_cast<quint32>(pixel[1] & 0xF8);
-            const quint32 mb = static_cast<quint32>(pixel[2] & 0xF8);
-            ++colours[(mr << 16) | (mg << 8) | mb];
+            const auto r = static_cast<quint32>(qRed(pixel));
+            const auto g = static_cast<quint32>(qGreen(pixel));
+            const auto b = static_cast<quint32>(qBlue(pixel));
+            ++histogram[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
 
-            const qreal r = pixel[0] / 255.0;
-            const qreal g = pixel[1] / 255.0;
-            const qreal b = pixel[2] / 255.0;
-            totalLuminance += std::sqrt(0.299 * r * r + 0.587 * g * g + 0.114 * b * b);
-            ++count;
+            lineLuminance[opaque++] = RED_LUMINANCE[r] + GREEN_LUMINANCE[g] + BLUE_LUMINANCE[b];
         }
+
+        totalLuminance += static_cast<qreal>(sumSqrt(lineLuminance.data(), opaque));
+        count += static_cast<qsizetype>(opaque);
     }
 
-    quint32 dominantColour = 0;
-    int maxCount = 0;
-    for (const auto& [colour, colourCount] : colours) {
+    // Bins hold the top 5 bits of each channel, so the colour is the bin's lower bound as before
+    const auto bin = static_cast<quint32>(std::max_element(histogram.cbegin(), histogram.cend()) - histogram.cbegin());
+    const quint32 dominantColour = (((bin >> 10) & 0x1F) << 19) | (((bin >> 5) & 0x1F) << 11) | ((bin & 0x1F) << 3);
+
+    QList<QColor> palette;
+    if (paletteSize > 0 && count > 0) {
         if (promise.isCanceled()) {
             return;
         }
 
-        if (colourCount > maxCount) {
-            dominantColour = colour;
-            maxCount = colourCount;
+        for (const QRgb rgb : colour::score(colour::quantise(histogram, QUANTISE_COLOURS), paletteSize)) {
+            palette << QColor(rgb);
         }
     }
 
-    promise.addResult(qMakePair(QColor((0xFFu << 24) | dominantColour), count == 0 ? 0.0 : totalLuminance / count));
+    promise.addResult(AnalysisResult{ QColor((0xFFu << 24) | dominantColour),
+        count == 0 ? 0.0 : totalLuminance / static_cast<qreal>(count), palette });
 }
 
 } // namespace caelestia
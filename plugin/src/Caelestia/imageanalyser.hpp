@@ -1,10 +1,13 @@
 #pragma once
 
+#include "analysiscache.hpp"
 #include <QtQuick/qquickitem.h>
 #include <qfuture.h>
 #include <qfuturewatcher.h>
 #include <qobject.h>
 #include <qqmlintegration.h>
+#include <qrect.h>
+#include <qurl.h>
 
 namespace caelestia {
 
@@ -15,8 +18,14 @@ class ImageAnalyser : public QObject {
     Q_PROPERTY(QString source READ source WRITE setSource NOTIFY sourceChanged)
     Q_PROPERTY(QQuickItem* sourceItem READ sourceItem WRITE setSourceItem NOTIFY sourceItemChanged)
     Q_PROPERTY(int rescaleSize READ rescaleSize WRITE setRescaleSize NOTIFY rescaleSizeChanged)
+    Q_PROPERTY(QRectF sourceRect READ sourceRect WRITE setSourceRect NOTIFY sourceRectChanged)
+    Q_PROPERTY(QUrl thumbnailDir READ thumbnailDir WRITE setThumbnailDir NOTIFY thumbnailDirChanged)
     Q_PROPERTY(QColor dominantColour READ dominantColour NOTIFY dominantColourChanged)
     Q_PROPERTY(qreal luminance READ luminance NOTIFY luminanceChanged)
+    Q_PROPERTY(int paletteSize READ paletteSize WRITE setPaletteSize NOTIFY paletteSizeChanged)
+    Q_PROPERTY(QList<QColor> palette READ palette NOTIFY paletteChanged)
+    Q_PROPERTY(bool schemeLight READ schemeLight WRITE setSchemeLight NOTIFY schemeLightChanged)
+    Q_PROPERTY(QVariantMap scheme READ scheme NOTIFY schemeChanged)
 
 public:
     explicit ImageAnalyser(QObject* parent = nullptr);
@@ -30,32 +39,76 @@ public:
     [[nodiscard]] int rescaleSize() const;
     void setRescaleSize(int rescaleSize);
 
+    // Region to analyse as fractions of the source's width and height. Empty analyses the whole source
+    [[nodiscard]] QRectF sourceRect() const;
+    void setSourceRect(const QRectF& sourceRect);
+
+    // CachingImageManager cache dir. When a source already has a mip pyramid there, the smallest level that
+    // covers rescaleSize is analysed instead of decoding the original
+    [[nodiscard]] QUrl thumbnailDir() const;
+    void setThumbnailDir(const QUrl& thumbnailDir);
+
     [[nodiscard]] QColor dominantColour() const;
     [[nodiscard]] qreal luminance() const;
 
+    [[nodiscard]] int paletteSize() const;
+    void setPaletteSize(int paletteSize);
+
+    [[nodiscard]] QList<QColor> palette() const;
+
+    [[nodiscard]] bool schemeLight() const;
+    void setSchemeLight(bool schemeLight);
+
+    [[nodiscard]] QVariantMap scheme() const;
+
     Q_INVOKABLE void requestUpdate();
 
+    // Reads and analyses a file the way an ImageAnalyser with it as its source does, without the result cache
+    static void analyseSource(QPromise<AnalysisResult>& promise, const QString& path, int rescaleSize, int paletteSize,
+        const QRectF& region, const QString& thumbnailDir);
+    // The analysis itself, adds a single result to promise unless it is canceled or the image is null
+    static void analyse(QPromise<AnalysisResult>& promise, const QImage& image, int rescaleSize, int paletteSize,
+        const QRectF& region);
+
 signals:
     void sourceChanged();
     void sourceItemChanged();
     void rescaleSizeChanged();
+    void sourceRectChanged();
+    void thumbnailDirChanged();
     void dominantColourChanged();
     void luminanceChanged();
+    void paletteSizeChanged();
+    void paletteChanged();
+    void schemeLightChanged();
+    void schemeChanged();
 
 private:
-    using AnalyseResult = QPair<QColor, qreal>;
-
-    QFutureWatcher<AnalyseResult>* const m_futureWatcher;
+    QFutureWatcher<AnalysisResult>* const m_futureWatcher;
 
     QString m_source;
     QQuickItem* m_sourceItem;
     int m_rescaleSize;
+    QRectF m_sourceRect;
+    QUrl m_thumbnailDir;
 
     QColor m_dominantColour;
     qreal m_luminance;
 
+    int m_paletteSize;
+    QList<QColor> m_palette;
+    bool m_schemeLight;
+    QVariantMap m_scheme;
+
+    QString m_resultKey;
+
     void update();
-    static void analyse(QPromise<AnalyseResult>& promise, const QImage& image, int rescaleSize);
+    void applyResult(const AnalysisResult& result);
+    void updateScheme();
+    void grabSourceItem();
+    void analyseFile(const QString& path);
+    [[nodiscard]] static QImage readSource(
+        const QString& path, int rescaleSize, const QRectF& region, const QString& thumbnailDir);
 };
 
 } // namespace caelestia
@@ -0,0 +1,345 @@
+#include "imageanalysismodel.hpp"
+
+#include "Internal/iopriority.hpp"
+#include "hct.hpp"
+#include "imageanalyser.hpp"
+#include <qtconcurrentrun.h>
+
+namespace caelestia {
+
+namespace {
+
+constexpr int CHANGED_INTERVAL = 250; // ms, results are announced in batches so sorting views don't resort per row
+
+} // namespace
+
+ImageAnalysisModel::ImageAnalysisModel(QObject* parent)
+    : QIdentityProxyModel(parent)
+    , m_canceled(std::make_shared<std::atomic_bool>(false))
+    , m_pathRoleName("path")
+    , m_pathRole(-1)
+    , m_active(true)
+    , m_rescaleSize(128)
+    , m_paletteSize(0)
+    , m_running(false)
+    , m_total(0)
+    , m_completed(0) {
+    m_pool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() / 2));
+    m_pool.setThreadPriority(QThread::IdlePriority);
+
+    m_changedTimer.setSingleShot(true);
+    m_changedTimer.setInterval(CHANGED_INTERVAL);
+    connect(&m_changedTimer, &QTimer::timeout, this, [this]() {
+        if (rowCount() > 0) {
+            emit dataChanged(index(0, 0), index(rowCount() - 1, 0),
+                { AnalysedRole, DominantColourRole, LuminanceRole, HueRole, ChromaRole, PaletteRole });
+        }
+    });
+
+    // Emitted before the reset that replacing the source causes
+    connect(this, &QAbstractProxyModel::sourceModelChanged, this, &ImageAnalysisModel::updatePathRole);
+    connect(this, &QAbstractItemModel::modelReset, this, &ImageAnalysisModel::reset);
+    connect(this, &QAbstractItemModel::rowsInserted, this, [this](const QModelIndex&, int first, int last) {
+        analyseRows(first, last);
+    });
+    connect(this, &QAbstractItemModel::rowsAboutToBeRemoved, this, [this](const QModelIndex&, int first, int last) {
+        forgetRows(first, last);
+    });
+}
+
+ImageAnalysisModel::~ImageAnalysisModel() {
+    // Queued jobs bail out early, the pool then waits for the running ones on destruction
+    *m_canceled = true;
+}
+
+QVariant ImageAnalysisModel::data(const QModelIndex& index, int role) const {
+    if (role < AnalysedRole || role > PaletteRole) {
+        return QIdentityProxyModel::data(index, role);
+    }
+
+    if (!index.isValid()) {
+        return QVariant();
+    }
+
+    const auto it = m_entries.constFind(pathAt(index.row()));
+    if (role == AnalysedRole) {
+        return it != m_entries.cend();
+    }
+    if (it == m_entries.cend()) {
+        return QVariant();
+    }
+
+    switch (role) {
+    case DominantColourRole:
+        return it->result.dominantColour;
+    case LuminanceRole:
+        return it->result.luminance;
+    case HueRole:
+        return it->hue;
+    case ChromaRole:
+        return it->chroma;
+    case PaletteRole:
+        return QVariant::fromValue(it->result.palette);
+    default:
+        return QVariant();
+    }
+}
+
+QHash<int, QByteArray> ImageAnalysisModel::roleNames() const {
+    auto roles = QIdentityProxyModel::roleNames();
+    roles.insert(AnalysedRole, "analysed");
+    roles.insert(DominantColourRole, "dominantColour");
+    roles.insert(LuminanceRole, "luminance");
+    roles.insert(HueRole, "hue");
+    roles.insert(ChromaRole, "chroma");
+    roles.insert(PaletteRole, "palette");
+    return roles;
+}
+
+QString ImageAnalysisModel::pathRoleName() const {
+    return m_pathRoleName;
+}
+
+void ImageAnalysisModel::setPathRoleName(const QString& pathRoleName) {
+    if (m_pathRoleName == pathRoleName) {
+        return;
+    }
+
+    m_pathRoleName = pathRoleName;
+    emit pathRoleNameChanged();
+
+    updatePathRole();
+    reset();
+}
+
+bool ImageAnalysisModel::active() const {
+    return m_active;
+}
+
+void ImageAnalysisModel::setActive(bool active) {
+    if (m_active == active) {
+        return;
+    }
+
+    m_active = active;
+    emit activeChanged();
+
+    // Results already in the model are kept, only the rows still missing one are analysed when reactivated
+    if (m_active) {
+        analyseRows(0, rowCount() - 1);
+    } else {
+        cancel();
+    }
+}
+
+int ImageAnalysisModel::rescaleSize() const {
+    return m_rescaleSize;
+}
+
+void ImageAnalysisModel::setRescaleSize(int rescaleSize) {
+    if (m_rescaleSize == rescaleSize) {
+        return;
+    }
+
+    m_rescaleSize = rescaleSize;
+    emit rescaleSizeChanged();
+
+    reset();
+}
+
+int ImageAnalysisModel::paletteSize() const {
+    return m_paletteSize;
+}
+
+void ImageAnalysisModel::setPaletteSize(int paletteSize) {
+    if (m_paletteSize == paletteSize) {
+        return;
+    }
+
+    m_paletteSize = paletteSize;
+    emit paletteSizeChanged();
+
+    reset();
+}
+
+QUrl ImageAnalysisModel::thumbnailDir() const {
+    return m_thumbnailDir;
+}
+
+void ImageAnalysisModel::setThumbnailDir(const QUrl& thumbnailDir) {
+    if (m_thumbnailDir == thumbnailDir) {
+        return;
+    }
+
+    // Only changes where sources are read from, so results already in the model stay valid
+    m_thumbnailDir = thumbnailDir;
+    emit thumbnailDirChanged();
+}
+
+int ImageAnalysisModel::maxThreads() const {
+    return m_pool.maxThreadCount();
+}
+
+void ImageAnalysisModel::setMaxThreads(int maxThreads) {
+    maxThreads = qMax(1, maxThreads);
+    if (m_pool.maxThreadCount() == maxThreads) {
+        return;
+    }
+
+    m_pool.setMaxThreadCount(maxThreads);
+    emit maxThreadsChanged();
+}
+
+bool ImageAnalysisModel::running() const {
+    return m_running;
+}
+
+int ImageAnalysisModel::total() const {
+    return m_total;
+}
+
+int ImageAnalysisModel::completed() const {
+    return m_completed;
+}
+
+qreal ImageAnalysisModel::progress() const {
+    return m_total > 0 ? static_cast<qreal>(m_completed) / m_total : 0.0;
+}
+
+QString ImageAnalysisModel::pathAt(int row) const {
+    if (m_pathRole == -1) {
+        return QString();
+    }
+    return QIdentityProxyModel::data(index(row, 0), m_pathRole).toString();
+}
+
+void ImageAnalysisModel::updatePathRole() {
+    m_pathRole = sourceModel() ? sourceModel()->roleNames().key(m_pathRoleName.toUtf8(), -1) : -1;
+    if (sourceModel() && m_pathRole == -1) {
+        qWarning() << "ImageAnalysisModel::updatePathRole: source model has no role named" << m_pathRoleName;
+    }
+}
+
+void ImageAnalysisModel::reset() {
+    cancel();
+
+    m_total = 0;
+    m_completed = 0;
+    emit progressChanged();
+
+    if (!m_entries.isEmpty()) {
+        m_entries.clear();
+        m_changedTimer.start();
+    }
+
+    analyseRows(0, rowCount() - 1);
+}
+
+void ImageAnalysisModel::analyseRows(int first, int last) {
+    if (!m_active || m_pathRole == -1) {
+        return;
+    }
+
+    QStringList paths;
+    for (int row = first; row <= last; ++row) {
+        const QString path = pathAt(row);
+        if (!path.isEmpty() && !m_entries.contains(path) && !m_queued.contains(path)) {
+            m_queued << path;
+            paths << path;
+        }
+    }
+
+    if (paths.isEmpty()) {
+        return;
+    }
+
+    // Joins the run in progress, if any
+    if (!m_running) {
+        m_total = 0;
+        m_completed = 0;
+    }
+    m_total += static_cast<int>(paths.size());
+    emit progressChanged();
+    setRunning(true);
+
+    const auto canceled = m_canceled;
+    const int rescaleSize = m_rescaleSize;
+    const int paletteSize = m_paletteSize;
+    const QString thumbnailDir = m_thumbnailDir.toLocalFile();
+
+    for (const auto& path : std::as_const(paths)) {
+        QtConcurrent::run(&m_pool,
+            [canceled, path, rescaleSize, paletteSize, thumbnailDir](QPromise<AnalysisResult>& promise) {
+                if (*canceled) {
+                    return;
+                }
+
+                internal::setIdleIoPriority();
+
+                const QString key = AnalysisCache::key(path, rescaleSize, paletteSize, QRectF());
+                if (const auto cached = AnalysisCache::instance().find(key)) {
+                    promise.addResult(*cached);
+                    return;
+                }
+
+                ImageAnalyser::analyseSource(promise, path, rescaleSize, paletteSize, QRectF(), thumbnailDir);
+
+                if (const auto future = promise.future(); future.isResultReadyAt(0)) {
+                    AnalysisCache::instance().insert(key, future.resultAt(0));
+                }
+            })
+            .then(this, [canceled, path, this](QFuture<AnalysisResult> future) {
+                if (*canceled) {
+                    return;
+                }
+
+                finishPath(path, future.isResultReadyAt(0) ? std::optional(future.resultAt(0)) : std::nullopt);
+            });
+    }
+}
+
+void ImageAnalysisModel::forgetRows(int first, int last) {
+    // A row inserted again later is analysed again, which the analysis cache makes cheap
+    for (int row = first; row <= last; ++row) {
+        const QString path = pathAt(row);
+        m_entries.remove(path);
+        m_queued.remove(path);
+    }
+}
+
+void ImageAnalysisModel::finishPath(const QString& path, const std::optional<AnalysisResult>& result) {
+    // Rows removed while their job was queued no longer want the result
+    if (m_queued.remove(path) && result) {
+        const auto hct = colour::Hct::fromRgb(result->dominantColour.rgb());
+        m_entries.insert(path, Entry{ *result, hct.hue, hct.chroma });
+
+        if (!m_changedTimer.isActive()) {
+            m_changedTimer.start();
+        }
+    }
+
+    ++m_completed;
+    emit progressChanged();
+
+    if (m_completed >= m_total) {
+        setRunning(false);
+        emit finished();
+    }
+}
+
+void ImageAnalysisModel::cancel() {
+    *m_canceled = true;
+    m_canceled = std::make_shared<std::atomic_bool>(false);
+    m_queued.clear();
+
+    setRunning(false);
+}
+
+void ImageAnalysisModel::setRunning(bool running) {
+    if (m_running != running) {
+        m_running = running;
+        emit runningChanged();
+    }
+}
+
+} // namespace caelestia
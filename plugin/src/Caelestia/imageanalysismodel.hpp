@@ -0,0 +1,121 @@
+#pragma once
+
+#include "analysiscache.hpp"
+#include <atomic>
+#include <memory>
+#include <qidentityproxymodel.h>
+#include <qqmlintegration.h>
+#include <qset.h>
+#include <qthreadpool.h>
+#include <qtimer.h>
+#include <qurl.h>
+
+namespace caelestia {
+
+// Adds the colour analysis of each row's file to a source model, e.g. a FileSystemModel, so views can sort and
+// filter by it. Rows are analysed in the background as they are inserted, and only while the model is active
+class ImageAnalysisModel : public QIdentityProxyModel {
+    Q_OBJECT
+    QML_ELEMENT
+
+    Q_PROPERTY(QString pathRoleName READ pathRoleName WRITE setPathRoleName NOTIFY pathRoleNameChanged)
+    Q_PROPERTY(bool active READ active WRITE setActive NOTIFY activeChanged)
+    Q_PROPERTY(int rescaleSize READ rescaleSize WRITE setRescaleSize NOTIFY rescaleSizeChanged)
+    Q_PROPERTY(int paletteSize READ paletteSize WRITE setPaletteSize NOTIFY paletteSizeChanged)
+    Q_PROPERTY(QUrl thumbnailDir READ thumbnailDir WRITE setThumbnailDir NOTIFY thumbnailDirChanged)
+    Q_PROPERTY(int maxThreads READ maxThreads WRITE setMaxThreads NOTIFY maxThreadsChanged)
+
+    Q_PROPERTY(bool running READ running NOTIFY runningChanged)
+    Q_PROPERTY(int total READ total NOTIFY progressChanged)
+    Q_PROPERTY(int completed READ completed NOTIFY progressChanged)
+    Q_PROPERTY(qreal progress READ progress NOTIFY progressChanged)
+
+public:
+    // Appended to the source's roles. Until analysed is true, the others are undefined
+    enum Role {
+        AnalysedRole = Qt::UserRole + 0x100,
+        DominantColourRole,
+        LuminanceRole,
+        HueRole,
+        ChromaRole,
+        PaletteRole
+    };
+    Q_ENUM(Role)
+
+    explicit ImageAnalysisModel(QObject* parent = nullptr);
+    ~ImageAnalysisModel();
+
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    [[nodiscard]] QString pathRoleName() const;
+    void setPathRoleName(const QString& pathRoleName);
+
+    [[nodiscard]] bool active() const;
+    void setActive(bool active);
+
+    [[nodiscard]] int rescaleSize() const;
+    void setRescaleSize(int rescaleSize);
+
+    [[nodiscard]] int paletteSize() const;
+    void setPaletteSize(int paletteSize);
+
+    [[nodiscard]] QUrl thumbnailDir() const;
+    void setThumbnailDir(const QUrl& thumbnailDir);
+
+    [[nodiscard]] int maxThreads() const;
+    void setMaxThreads(int maxThreads);
+
+    [[nodiscard]] bool running() const;
+    [[nodiscard]] int total() const;
+    [[nodiscard]] int completed() const;
+    [[nodiscard]] qreal progress() const;
+
+signals:
+    void pathRoleNameChanged();
+    void activeChanged();
+    void rescaleSizeChanged();
+    void paletteSizeChanged();
+    void thumbnailDirChanged();
+    void maxThreadsChanged();
+    void runningChanged();
+    void progressChanged();
+    void finished();
+
+private:
+    struct Entry {
+        AnalysisResult result;
+        qreal hue = 0.0;
+        qreal chroma = 0.0;
+    };
+
+    QThreadPool m_pool;
+    std::shared_ptr<std::atomic_bool> m_canceled;
+
+    // Results by path, so they follow rows the source moves, removes or inserts again
+    QHash<QString, Entry> m_entries;
+    QSet<QString> m_queued;
+    QTimer m_changedTimer;
+
+    QString m_pathRoleName;
+    int m_pathRole;
+    bool m_active;
+    int m_rescaleSize;
+    int m_paletteSize;
+    QUrl m_thumbnailDir;
+
+    bool m_running;
+    int m_total;
+    int m_completed;
+
+    [[nodiscard]] QString pathAt(int row) const;
+    void updatePathRole();
+    void reset();
+    void analyseRows(int first, int last);
+    void forgetRows(int first, int last);
+    void finishPath(const QString& path, const std::optional<AnalysisResult>& result);
+    void cancel();
+    void setRunning(bool running);
+};
+
+} // namespace caelestia
@@ -0,0 +1,495 @@
+#include "quantiser.hpp"
+
+#include "hct.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
+namespace caelestia::colour {
+
+namespace {
+
+constexpr int INDEX_BITS = 5;
+constexpr int SIDE_LENGTH = (1 << INDEX_BITS) + 1;
+constexpr std::size_t TOTAL_SIZE = SIDE_LENGTH * SIDE_LENGTH * SIDE_LENGTH;
+
+constexpr int MAX_ITERATIONS = 10;
+
+constexpr double TARGET_CHROMA = 48.0;
+constexpr double WEIGHT_PROPORTION = 0.7;
+constexpr double WEIGHT_CHROMA_ABOVE = 0.3;
+constexpr double WEIGHT_CHROMA_BELOW = 0.1;
+constexpr double CUTOFF_CHROMA = 5.0;
+constexpr double CUTOFF_EXCITED_PROPORTION = 0.01;
+constexpr QRgb FALLBACK_COLOUR = 0xff4285f4; // Google blue, as in Material
+
+enum class Direction {
+    Red,
+    Green,
+    Blue
+};
+
+struct Box {
+    int r0 = 0;
+    int r1 = 0;
+    int g0 = 0;
+    int g1 = 0;
+    int b0 = 0;
+    int b1 = 0;
+    int volume = 0;
+};
+
+// Centre of a 5 bit bin, the histogram only knows which bin a colour fell into
+int binCentre(quint32 bin) {
+    return static_cast<int>(((bin & 0x1F) << 3) | 4);
+}
+
+QRgb binColour(std::size_t bin) {
+    const auto index = static_cast<quint32>(bin);
+    return qRgb(binCentre(index >> 10), binCentre(index >> 5), binCentre(index));
+}
+
+std::size_t index(int r, int g, int b) {
+    return static_cast<std::size_t>((r * SIDE_LENGTH + g) * SIDE_LENGTH + b);
+}
+
+double sanitiseDegrees(double degrees) {
+    degrees = std::fmod(degrees, 360.0);
+    return degrees < 0.0 ? degrees + 360.0 : degrees;
+}
+
+double differenceDegrees(double a, double b) {
+    return 180.0 - std::abs(std::abs(a - b) - 180.0);
+}
+
+class WuQuantiser {
+public:
+    explicit WuQuantiser(const ColourHistogram& histogram)
+        : m_weights(TOTAL_SIZE, 0)
+        , m_momentsR(TOTAL_SIZE, 0)
+        , m_momentsG(TOTAL_SIZE, 0)
+        , m_momentsB(TOTAL_SIZE, 0)
+        , m_moments(TOTAL_SIZE, 0.0) {
+        for (std::size_t bin = 0; bin < histogram.size(); ++bin) {
+            const quint32 count = histogram[bin];
+            if (count == 0) {
+                continue;
+            }
+
+            const QRgb colour = binColour(bin);
+            const auto r = static_cast<qint64>(qRed(colour));
+            const auto g = static_cast<qint64>(qGreen(colour));
+            const auto b = static_cast<qint64>(qBlue(colour));
+            const auto i = static_cast<quint32>(bin);
+            const std::size_t idx = index(static_cast<int>((i >> 10) & 0x1F) + 1,
+                static_cast<int>((i >> 5) & 0x1F) + 1, static_cast<int>(i & 0x1F) + 1);
+
+            m_weights[idx] += count;
+            m_momentsR[idx] += r * count;
+            m_momentsG[idx] += g * count;
+            m_momentsB[idx] += b * count;
+            m_moments[idx] += static_cast<double>(count) * static_cast<double>(r * r + g * g + b * b);
+        }
+
+        computeMoments();
+    }
+
+    std::vector<QRgb> quantise(int maxColours) {
+        std::vector<Box> boxes(static_cast<std::size_t>(maxColours));
+        std::vector<double> variances(static_cast<std::size_t>(maxColours), 0.0);
+        boxes[0] = { 0, SIDE_LENGTH - 1, 0, SIDE_LENGTH - 1, 0, SIDE_LENGTH - 1, 0 };
+
+        std::size_t count = boxes.size();
+        std::size_t next = 0;
+        for (std::size_t i = 1; i < boxes.size(); ++i) {
+            if (cut(boxes[next], boxes[i])) {
+                variances[next] = boxes[next].volume > 1 ? variance(boxes[next]) : 0.0;
+                variances[i] = boxes[i].volume > 1 ? variance(boxes[i]) : 0.0;
+            } else {
+                variances[next] = 0.0;
+                --i;
+            }
+
+            next = 0;
+            double maxVariance = variances[0];
+            for (std::size_t j = 1; j <= i; ++j) {
+                if (variances[j] > maxVariance) {
+                    maxVariance = variances[j];
+                    next = j;
+                }
+            }
+
+            if (maxVariance <= 0.0) {
+                count = i + 1;
+                break;
+            }
+        }
+
+        std::vector<QRgb> colours;
+        for (std::size_t i = 0; i < count; ++i) {
+            const qint64 weight = volume(boxes[i], m_weights);
+            if (weight > 0) {
+                colours.push_back(qRgb(static_cast<int>(volume(boxes[i], m_momentsR) / weight),
+                    static_cast<int>(volume(boxes[i], m_momentsG) / weight),
+                    static_cast<int>(volume(boxes[i], m_momentsB) / weight)));
+            }
+        }
+        return colours;
+    }
+
+private:
+    std::vector<qint64> m_weights;
+    std::vector<qint64> m_momentsR;
+    std::vector<qint64> m_momentsG;
+    std::vector<qint64> m_momentsB;
+    std::vector<double> m_moments;
+
+    void computeMoments() {
+        for (int r = 1; r < SIDE_LENGTH; ++r) {
+            std::array<qint64, SIDE_LENGTH> area{};
+            std::array<qint64, SIDE_LENGTH> areaR{};
+            std::array<qint64, SIDE_LENGTH> areaG{};
+            std::array<qint64, SIDE_LENGTH> areaB{};
+            std::array<double, SIDE_LENGTH> area2{};
+
+            for (int g = 1; g < SIDE_LENGTH; ++g) {
+                qint64 line = 0;
+                qint64 lineR = 0;
+                qint64 lineG = 0;
+                qint64 lineB = 0;
+                double line2 = 0.0;
+
+                for (int b = 1; b < SIDE_LENGTH; ++b) {
+                    const std::size_t idx = index(r, g, b);
+                    const auto ab = static_cast<std::size_t>(b);
+                    line += m_weights[idx];
+                    lineR += m_momentsR[idx];
+                    lineG += m_momentsG[idx];
+                    lineB += m_momentsB[idx];
+                    line2 += m_moments[idx];
+
+                    area[ab] += line;
+                    areaR[ab] += lineR;
+                    areaG[ab] += lineG;
+                    areaB[ab] += lineB;
+                    area2[ab] += line2;
+
+                    const std::size_t previous = index(r - 1, g, b);
+                    m_weights[idx] = m_weights[previous] + area[ab];
+                    m_momentsR[idx] = m_momentsR[previous] + areaR[ab];
+                    m_momentsG[idx] = m_momentsG[previous] + areaG[ab];
+                    m_momentsB[idx] = m_momentsB[previous] + areaB[ab];
+                    m_moments[idx] = m_moments[previous] + area2[ab];
+                }
+            }
+        }
+    }
+
+    template <typename T> static T volume(const Box& box, const std::vector<T>& moment) {
+        return moment[index(box.r1, box.g1, box.b1)] - moment[index(box.r1, box.g1, box.b0)] -
+               moment[index(box.r1, box.g0, box.b1)] + moment[index(box.r1, box.g0, box.b0)] -
+               moment[index(box.r0, box.g1, box.b1)] + moment[index(box.r0, box.g1, box.b0)] +
+               moment[index(box.r0, box.g0, box.b1)] - moment[index(box.r0, box.g0, box.b0)];
+    }
+
+    static qint64 bottom(const Box& box, Direction direction, const std::vector<qint64>& moment) {
+        switch (direction) {
+        case Direction::Red:
+            return -moment[index(box.r0, box.g1, box.b1)] + moment[index(box.r0, box.g1, box.b0)] +
+                   moment[index(box.r0, box.g0, box.b1)] - moment[index(box.r0, box.g0, box.b0)];
+        case Direction::Green:
+            return -moment[index(box.r1, box.g0, box.b1)] + moment[index(box.r1, box.g0, box.b0)] +
+                   moment[index(box.r0, box.g0, box.b1)] - moment[index(box.r0, box.g0, box.b0)];
+        case Direction::Blue:
+            return -moment[index(box.r1, box.g1, box.b0)] + moment[index(box.r1, box.g0, box.b0)] +
+                   moment[index(box.r0, box.g1, box.b0)] - moment[index(box.r0, box.g0, box.b0)];
+        }
+        return 0;
+    }
+
+    static qint64 top(const Box& box, Direction direction, int position, const std::vector<qint64>& moment) {
+        switch (direction) {
+        case Direction::Red:
+            return moment[index(position, box.g1, box.b1)] - moment[index(position, box.g1, box.b0)] -
+                   moment[index(position, box.g0, box.b1)] + moment[index(position, box.g0, box.b0)];
+        case Direction::Green:
+            return moment[index(box.r1, position, box.b1)] - moment[index(box.r1, position, box.b0)] -
+                   moment[index(box.r0, position, box.b1)] + moment[index(box.r0, position, box.b0)];
+        case Direction::Blue:
+            return moment[index(box.r1, box.g1, position)] - moment[index(box.r1, box.g0, position)] -
+                   moment[index(box.r0, box.g1, position)] + moment[index(box.r0, box.g0, position)];
+        }
+        return 0;
+    }
+
+    double variance(const Box& box) const {
+        const auto dr = static_cast<double>(volume(box, m_momentsR));
+        const auto dg = static_cast<double>(volume(box, m_momentsG));
+        const auto db = static_cast<double>(volume(box, m_momentsB));
+        const double xx = volume(box, m_moments);
+        return xx - (dr * dr + dg * dg + db * db) / static_cast<double>(volume(box, m_weights));
+    }
+
+    double maximise(const Box& box, Direction direction, int first, int last, int& cut, qint64 wholeR, qint64 wholeG,
+        qint64 wholeB, qint64 wholeW) const {
+        const qint64 bottomR = bottom(box, direction, m_momentsR);
+        const qint64 bottomG = bottom(box, direction, m_momentsG);
+        const qint64 bottomB = bottom(box, direction, m_momentsB);
+        const qint64 bottomW = bottom(box, direction, m_weights);
+
+        double max = 0.0;
+        cut = -1;
+
+        for (int i = first; i < last; ++i) {
+            auto halfR = static_cast<double>(bottomR + top(box, direction, i, m_momentsR));
+            auto halfG = static_cast<double>(bottomG + top(box, direction, i, m_momentsG));
+            auto halfB = static_cast<double>(bottomB + top(box, direction, i, m_momentsB));
+            const qint64 halfW = bottomW + top(box, direction, i, m_weights);
+            if (halfW == 0) {
+                continue;
+            }
+
+            double temp = (halfR * halfR + halfG * halfG + halfB * halfB) / static_cast<double>(halfW);
+
+            halfR = static_cast<double>(wholeR) - halfR;
+            halfG = static_cast<double>(wholeG) - halfG;
+            halfB = static_cast<double>(wholeB) - halfB;
+            const qint64 otherW = wholeW - halfW;
+            if (otherW == 0) {
+                continue;
+            }
+
+            temp += (halfR * halfR + halfG * halfG + halfB * halfB) / static_cast<double>(otherW);
+            if (temp > max) {
+                max = temp;
+                cut = i;
+            }
+        }
+
+        return max;
+    }
+
+    bool cut(Box& one, Box& two) const {
+        const qint64 wholeR = volume(one, m_momentsR);
+        const qint64 wholeG = volume(one, m_momentsG);
+        const qint64 wholeB = volume(one, m_momentsB);
+        const qint64 wholeW = volume(one, m_weights);
+
+        int cutR = -1;
+        int cutG = -1;
+        int cutB = -1;
+        const double maxR = maximise(one, Direction::Red, one.r0 + 1, one.r1, cutR, wholeR, wholeG, wholeB, wholeW);
+        const double maxG = maximise(one, Direction::Green, one.g0 + 1, one.g1, cutG, wholeR, wholeG, wholeB, wholeW);
+        const double maxB = maximise(one, Direction::Blue, one.b0 + 1, one.b1, cutB, wholeR, wholeG, wholeB, wholeW);
+
+        Direction direction;
+        if (maxR >= maxG && maxR >= maxB) {
+            if (cutR < 0) {
+                return false;
+            }
+            direction = Direction::Red;
+        } else if (maxG >= maxR && maxG >= maxB) {
+            direction = Direction::Green;
+        } else {
+            direction = Direction::Blue;
+        }
+
+        two.r1 = one.r1;
+        two.g1 = one.g1;
+        two.b1 = one.b1;
+
+        switch (direction) {
+        case Direction::Red:
+            one.r1 = cutR;
+            two.r0 = one.r1;
+            two.g0 = one.g0;
+            two.b0 = one.b0;
+            break;
+        case Direction::Green:
+            one.g1 = cutG;
+            two.r0 = one.r0;
+            two.g0 = one.g1;
+            two.b0 = one.b0;
+            break;
+        case Direction::Blue:
+            one.b1 = cutB;
+            two.r0 = one.r0;
+            two.g0 = one.g0;
+            two.b0 = one.b1;
+            break;
+        }
+
+        one.volume = (one.r1 - one.r0) * (one.g1 - one.g0) * (one.b1 - one.b0);
+        two.volume = (two.r1 - two.r0) * (two.g1 - two.g0) * (two.b1 - two.b0);
+        return true;
+    }
+};
+
+double distance(const Lab& a, const Lab& b) {
+    const double dl = a.l - b.l;
+    const double da = a.a - b.a;
+    const double db = a.b - b.b;
+    return dl * dl + da * da + db * db;
+}
+
+} // namespace
+
+std::vector<ColourPopulation> quantise(const ColourHistogram& histogram, int maxColours) {
+    std::vector<Lab> points;
+    std::vector<quint32> counts;
+    for (std::size_t bin = 0; bin < histogram.size(); ++bin) {
+        if (histogram[bin] > 0) {
+            points.push_back(Lab::fromRgb(binColour(bin)));
+            counts.push_back(histogram[bin]);
+        }
+    }
+
+    if (points.empty() || maxColours <= 0) {
+        return {};
+    }
+
+    std::vector<Lab> clusters;
+    for (const QRgb colour : WuQuantiser(histogram).quantise(maxColours)) {
+        clusters.push_back(Lab::fromRgb(colour));
+    }
+
+    // Weighted k-means seeded with the Wu boxes, points are unique bins weighted by their pixel count
+    std::vector<std::size_t> assignments(points.size(), std::numeric_limits<std::size_t>::max());
+    std::vector<quint32> populations(clusters.size(), 0);
+
+    for (int iteration = 0; iteration < MAX_ITERATIONS; ++iteration) {
+        bool changed = false;
+        for (std::size_t i = 0; i < points.size(); ++i) {
+            std::size_t nearest = 0;
+            double nearestDistance = std::numeric_limits<double>::max();
+            for (std::size_t j = 0; j < clusters.size(); ++j) {
+                const double d = distance(points[i], clusters[j]);
+                if (d < nearestDistance) {
+                    nearestDistance = d;
+                    nearest = j;
+                }
+            }
+
+            if (assignments[i] != nearest) {
+                assignments[i] = nearest;
+                changed = true;
+            }
+        }
+
+        if (!changed && iteration > 0) {
+            break;
+        }
+
+        std::vector<Lab> sums(clusters.size(), Lab{ 0.0, 0.0, 0.0 });
+        std::fill(populations.begin(), populations.end(), 0);
+        for (std::size_t i = 0; i < points.size(); ++i) {
+            const auto weight = static_cast<double>(counts[i]);
+            auto& sum = sums[assignments[i]];
+            sum.l += points[i].l * weight;
+            sum.a += points[i].a * weight;
+            sum.b += points[i].b * weight;
+            populations[assignments[i]] += counts[i];
+        }
+
+        for (std::size_t j = 0; j < clusters.size(); ++j) {
+            if (populations[j] > 0) {
+                const auto population = static_cast<double>(populations[j]);
+                clusters[j] = { sums[j].l / population, sums[j].a / population, sums[j].b / population };
+            }
+        }
+    }
+
+    std::vector<ColourPopulation> result;
+    for (std::size_t j = 0; j < clusters.size(); ++j) {
+        if (populations[j] == 0) {
+            continue;
+        }
+
+        const QRgb colour = clusters[j].toRgb();
+        const auto it = std::find_if(result.begin(), result.end(), [colour](const ColourPopulation& existing) {
+            return existing.colour == colour;
+        });
+        if (it != result.end()) {
+            it->population += populations[j];
+        } else {
+            result.push_back({ colour, populations[j] });
+        }
+    }
+
+    return result;
+}
+
+std::vector<QRgb> score(const std::vector<ColourPopulation>& colours, int count) {
+    double total = 0.0;
+    for (const auto& colour : colours) {
+        total += colour.population;
+    }
+
+    std::vector<Hct> hcts;
+    std::array<double, 360> hueProportions{};
+    for (const auto& colour : colours) {
+        const Hct hct = Hct::fromRgb(colour.colour);
+        hcts.push_back(hct);
+        const auto hue = static_cast<std::size_t>(std::floor(hct.hue)) % hueProportions.size();
+        hueProportions[hue] += colour.population / total;
+    }
+
+    // Proportion of each hue including its neighbours, so large areas of similar hues are favoured
+    std::array<double, 360> excitedProportions{};
+    for (int hue = 0; hue < 360; ++hue) {
+        const double proportion = hueProportions[static_cast<std::size_t>(hue)];
+        for (int neighbour = hue - 14; neighbour < hue + 16; ++neighbour) {
+            excitedProportions[static_cast<std::size_t>((neighbour + 360) % 360)] += proportion;
+        }
+    }
+
+    std::vector<std::pair<Hct, double>> scored;
+    for (const auto& hct : hcts) {
+        const auto hue = static_cast<std::size_t>(std::lround(sanitiseDegrees(hct.hue))) % excitedProportions.size();
+        const double proportion = excitedProportions[hue];
+        if (hct.chroma < CUTOFF_CHROMA || proportion <= CUTOFF_EXCITED_PROPORTION) {
+            continue;
+        }
+
+        const double proportionScore = proportion * 100.0 * WEIGHT_PROPORTION;
+        const double chromaWeight = hct.chroma < TARGET_CHROMA ? WEIGHT_CHROMA_BELOW : WEIGHT_CHROMA_ABOVE;
+        const double chromaScore = (hct.chroma - TARGET_CHROMA) * chromaWeight;
+        scored.emplace_back(hct, proportionScore + chromaScore);
+    }
+    std::stable_sort(scored.begin(), scored.end(), [](const auto& a, const auto& b) {
+        return a.second > b.second;
+    });
+
+    // Prefer hues far apart, relaxing the minimum distance until enough colours are found
+    const auto desired = static_cast<std::size_t>(std::max(count, 1));
+    std::vector<Hct> chosen;
+    for (int minDifference = 90; minDifference >= 15; --minDifference) {
+        chosen.clear();
+        for (const auto& [hct, value] : scored) {
+            const bool distinct = std::none_of(chosen.cbegin(), chosen.cend(), [&hct, minDifference](const Hct& other) {
+                return differenceDegrees(hct.hue, other.hue) < minDifference;
+            });
+            if (distinct) {
+                chosen.push_back(hct);
+            }
+            if (chosen.size() >= desired) {
+                break;
+            }
+        }
+        if (chosen.size() >= desired) {
+            break;
+        }
+    }
+
+    std::vector<QRgb> result;
+    for (const auto& hct : chosen) {
+        result.push_back(Hct::toRgb(hct.hue, hct.chroma, hct.tone));
+    }
+    if (result.empty()) {
+        result.push_back(FALLBACK_COLOUR);
+    }
+    return result;
+}
+
+} // namespace caelestia::colour
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <qrgb.h>
+#include <vector>
+
+namespace caelestia::colour {
+
+// Histogram of colours binned by the top 5 bits of each channel, indexed by (r << 10) | (g << 5) | b
+using ColourHistogram = std::vector<quint32>;
+
+struct ColourPopulation {
+    QRgb colour;
+    quint32 population;
+};
+
+// Wu quantisation refined by weighted k-means in L*a*b*, like Material's Celebi quantiser
+[[nodiscard]] std::vector<ColourPopulation> quantise(const ColourHistogram& histogram, int maxColours);
+
+// Ranks colours by hue proportion and chroma and picks up to count distinct hues, most suitable seed first
+[[nodiscard]] std::vector<QRgb> score(const std::vector<ColourPopulation>& colours, int count);
+
+} // namespace caelestia::colour
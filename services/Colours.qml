@@ -14,6 +14,7 @@ Singleton {
     property bool showPreview
     property string scheme
     property string flavour
+    property string variant
     readonly property bool light: showPreview ? previewLight : currentLight
     property bool currentLight
     property bool previewLight
@@ -62,6 +63,7 @@ Singleton {
         if (!isPreview) {
             root.scheme = scheme.name;
             flavour = scheme.flavour;
+            variant = scheme.variant ?? "";
             currentLight = scheme.mode === "light";
         } else {
             previewLight = scheme.mode === "light";
@@ -74,6 +76,20 @@ Singleton {
         }
     }
 
+    function loadPreview(colours: var, light: bool): void {
+        previewLight = light;
+
+        // Only m3 colours are given, so don't leave the terminal colours of whatever was previewed last
+        for (let i = 0; i < 16; i++)
+            preview[`term${i}`] = current[`term${i}`];
+
+        for (const [name, colour] of Object.entries(colours)) {
+            const propName = `m3${name}`;
+            if (preview.hasOwnProperty(propName))
+                preview[propName] = colour;
+        }
+    }
+
     function setMode(mode: string): void {
         Quickshell.execDetached(["caelestia", "scheme", "set", "--notify", "-m", mode]);
     }
@@ -89,6 +105,7 @@ Singleton {
         id: analyser
 
         source: Wallpapers.current
+        thumbnailDir: Qt.resolvedUrl(Paths.imagecache)
     }
 
     component Transparency: QtObject {
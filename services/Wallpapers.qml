@@ -2,12 +2,14 @@ pragma Singleton
 
 import qs.config
 import qs.utils
+import Caelestia
+import Caelestia.Internal
 import Caelestia.Models
 import Quickshell
 import Quickshell.Io
 import QtQuick
 
-Searcher {
+Singleton {
     id: root
 
     readonly property string currentNamePath: `${Paths.state}/wallpaper/path.txt`
@@ -18,6 +20,12 @@ Searcher {
     property string previewPath
     property string actualCurrent
     property bool previewColourLock
+    property bool previewColoursExact
+    // The native scheme is only shown ahead of the cli's when it is what the cli will produce, so the preview never
+    // switches palette or mode twice
+    readonly property bool nativeSchemeExact: !Config.services.smartScheme && Colours.variant === "tonalspot"
+    readonly property alias model: wallpapers
+    readonly property alias analysis: analysis
 
     function setWallpaper(path: string): void {
         actualCurrent = path;
@@ -28,8 +36,10 @@ Searcher {
         previewPath = path;
         showPreview = true;
 
-        if (Colours.scheme === "dynamic")
+        if (Colours.scheme === "dynamic") {
+            previewColoursExact = false;
             getPreviewColoursProc.running = true;
+        }
     }
 
     function stopPreview(): void {
@@ -38,13 +48,6 @@ Searcher {
             Colours.showPreview = false;
     }
 
-    list: wallpapers.entries
-    key: "relativePath"
-    useFuzzy: Config.launcher.useFuzzy.wallpapers
-    extraOpts: useFuzzy ? ({}) : ({
-            forward: false
-        })
-
     IpcHandler {
         target: "wallpaper"
 
@@ -57,7 +60,7 @@ Searcher {
         }
 
         function list(): string {
-            return root.list.map(w => w.path).join("\n");
+            return wallpapers.paths.join("\n");
         }
     }
 
@@ -77,6 +80,54 @@ Searcher {
         recursive: true
         path: Paths.wallsdir
         filter: FileSystemModel.Images
+        snapshot: true
+
+        onEntriesChanged: prewarmTimer.restart()
+    }
+
+    ImageAnalysisModel {
+        id: analysis
+
+        // Wallpapers with their brightness and hue, only worked out while the picker sorts by them
+        sourceModel: wallpapers
+        active: Config.launcher.wallpaperSort !== "name"
+        thumbnailDir: Qt.resolvedUrl(Paths.imagecache)
+    }
+
+    CachingImagePrewarmer {
+        id: prewarmer
+
+        readonly property real dpr: Quickshell.screens[0]?.devicePixelRatio ?? 1
+        readonly property int width: Config.launcher.sizes.wallpaperWidth
+
+        // Same size and fill mode as the launcher wallpaper items, so the picker opens with a warm cache
+        cacheDir: Qt.resolvedUrl(Paths.imagecache)
+        size: Qt.size(Math.round(width * dpr), Math.round(width / 16 * 9 * dpr))
+        fillMode: Image.PreserveAspectCrop
+    }
+
+    Timer {
+        id: prewarmTimer
+
+        interval: 5000
+        onTriggered: prewarmer.prewarm(wallpapers.paths)
+    }
+
+    ImageAnalyser {
+        id: previewAnalyser
+
+        // Native scheme shown straight away, the cli's then only adds the terminal colours
+        source: root.showPreview && root.nativeSchemeExact && Colours.scheme === "dynamic" ? root.previewPath : ""
+        thumbnailDir: Qt.resolvedUrl(Paths.imagecache)
+        paletteSize: 1
+        schemeLight: Colours.currentLight
+
+        onSchemeChanged: {
+            if (root.showPreview && root.nativeSchemeExact && !root.previewColoursExact && Colours.scheme === "dynamic" && Object.keys(scheme).length > 0) {
+                Colours.loadPreview(scheme, schemeLight);
+                Colours.showPreview = true;
+            }
+        }
     }
 
     Process {
@@ -85,6 +136,7 @@ Searcher {
         command: ["caelestia", "wallpaper", "-p", root.previewPath, ...root.smartArg]
         stdout: StdioCollector {
             onStreamFinished: {
+                root.previewColoursExact = true;
                 Colours.load(text, true);
                 Colours.showPreview = true;
             }